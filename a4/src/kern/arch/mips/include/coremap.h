@@ -47,12 +47,18 @@ struct lpage;
 #define INVALID_PADDR	((paddr_t)0)
 
 /* MMU control */
+int mmu_initas(struct addrspace *as);
+void mmu_cleanupas(struct addrspace *as);
+int mmu_prepare(struct addrspace *as, vaddr_t va);
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
+void mmu_protect_page(paddr_t pa);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_map_zero(struct addrspace *as, vaddr_t va);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
+paddr_t coremap_allocuser_spare(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
 
 /* physical page pinning */
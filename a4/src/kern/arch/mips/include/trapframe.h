@@ -101,10 +101,12 @@ struct trapframe {
 void mips_usermode(struct trapframe *tf);
 
 /*
- * Arrays used to load the kernel stack and curthread on trap entry.
+ * Arrays used to load the kernel stack and curthread on trap entry,
+ * and the page table on TLB refill.
  */
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
+extern vaddr_t cpupagetables[];
 
 
 #endif /* _MIPS_TRAPFRAME_H_ */
@@ -130,15 +130,18 @@ void cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm);
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  *
- * Note that because IPI delivery isn't instantaneous, we may
- * sometimes end up flushing out a translation other than the one
- * someone wanted gone, unless we check that the coremap index
- * matches.
+ * A shootdown names a virtual page and the ASID (with generation) the
+ * address space has on the target CPU; the target drops the page from
+ * its TLB if that ASID is still current there. TLB entries can be
+ * loaded from the page tables without the coremap knowing (see
+ * coremap.c), so we can't say which slot to hit. ts_ticket tells the
+ * sender when its request has been done.
  */
 
 struct tlbshootdown {
-	int ts_tlbix;
-	unsigned ts_coremapindex;
+	uint32_t ts_asid;
+	vaddr_t ts_vaddr;
+	uint32_t ts_ticket;
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -37,6 +37,7 @@
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
 #include <copyinout.h> /* A4 SETUP - new include for lseek */
+#include "opt-dumbvm.h" /* dumbvm has no sbrk or mmap */
 /*
  * System call dispatcher.
  *
@@ -89,6 +90,9 @@ syscall(struct trapframe *tf)
 	off_t pos;
 	off_t retval64 = 0;
 	/* END A4 SETUP */
+#if !OPT_DUMBVM
+	int fd;		/* mmap's fd, which is on the stack */
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -117,6 +121,11 @@ syscall(struct trapframe *tf)
 				     (userptr_t)tf->tf_a1);
 		    break;
 
+	    case SYS_nanosleep:
+		    err = sys_nanosleep((userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+		    break;
+
             /* ASST1: These implementations of read and write only work for
              * console I/O (stdin, stdout and stderr file descriptors)
              */
@@ -142,6 +151,14 @@ syscall(struct trapframe *tf)
 		    err = sys_fork(tf, &retval);
 		    break;
 
+	    case SYS_getpriority:
+		    err = sys_getpriority(tf->tf_a0, tf->tf_a1, &retval);
+		    break;
+
+	    case SYS_setpriority:
+		    err = sys_setpriority(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		    break;
+
             /* ASST1 - You need to fill in the code for each of these cases */
             case SYS_getpid:
             case SYS_waitpid:
@@ -152,6 +169,33 @@ syscall(struct trapframe *tf)
 
 	    /* Even more system calls will go here */
 
+#if !OPT_DUMBVM
+	    /* address space calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk(tf->tf_a0, &retval);
+		break;
+	    case SYS_mmap:
+		/*
+		 * The fd and offset don't fit in registers; the
+		 * offset, being 64-bit, is aligned to sp+24.
+		 */
+		err = copyin((userptr_t)(tf->tf_sp+16), &fd, sizeof(int));
+		if (err) {
+			break;
+		}
+		err = copyin((userptr_t)(tf->tf_sp+24), &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			       tf->tf_a3, fd, pos, &retval);
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+#endif
+
 	    /* BEGIN A4 SETUP */
            
             /* Note: SYS_read and SYS_write are above, from A1 starter code.*/
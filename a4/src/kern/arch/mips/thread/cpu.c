@@ -59,6 +59,14 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Likewise, the fast-path TLB refill code finds the page table of the
+ * address space each CPU is running in cpupagetables[]. It's kept by
+ * the VM system (see mmu_setas); 0 means take the slow path.
+ */
+
+vaddr_t cpupagetables[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -44,6 +44,8 @@
 #include <addrspace.h>
 #include <machine/coremap.h>
 #include <machine/tlb.h>
+#include <mips/trapframe.h>	/* for cpupagetables[] */
+#include <platform/maxcpus.h>
 #include <vfs.h>
 #include <vnode.h>
 
@@ -55,9 +57,21 @@
  * MIPS coremap/MMU-control implementation.
  *
  * The MIPS has a completely software-refilled TLB. It doesn't define
- * hardware-level pagetables. Thus, for simplicity, we won't use any.
- * (In real life, one might anyway, to allow faster TLB refill
- * handling.)
+ * hardware-level pagetables, but we keep one per address space anyway
+ * so TLB misses on resident pages can be refilled by a few
+ * instructions in the UTLB exception handler (exception-mips1.S)
+ * instead of a trip through vm_fault. The page table holds ready-made
+ * TLBLO values; it's filled in by mmu_map, and an entry without
+ * TLBLO_VALID sends the refill code to the slow path.
+ *
+ * Because the refill code loads TLB entries behind our back, we don't
+ * know which TLB slots a page is in. Instead the coremap records every
+ * page table entry that maps each page, on a list of cm_mappings
+ * hanging off its entry (cm_maps); to get rid of the page's mappings,
+ * clear each of those and shoot the virtual page down on every CPU
+ * that has the address space loaded. A page shared copy-on-write
+ * after fork can be mapped read-only by several address spaces at
+ * once this way, instead of being passed back and forth.
  *
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
@@ -71,25 +85,94 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * The pageout daemon starts evicting when fewer than 1/CM_LOWATER_FRAC
+ * of the pages are free, and keeps going until twice that many are
+ * free, so faulting threads rarely have to evict pages themselves.
+ */
+#define CM_LOWATER_FRAC		16
+#define CM_LOWATER_MIN		4
+
+/*
+ * Page table. The first level has one entry per 4M of user address
+ * space, pointing to a page of second-level entries (or NULL); the
+ * second level has one TLBLO value per page, or 0. The refill code in
+ * exception-mips1.S knows this layout.
+ */
+#define PT_L1SHIFT		22
+#define PT_L1SIZE		(USERSPACETOP >> PT_L1SHIFT)
+#define PT_L2SHIFT		12
+#define PT_L2SIZE		(PAGE_SIZE / sizeof(uint32_t))
+
+struct pagetable {
+	uint32_t *pt_l2[PT_L1SIZE];
+	uint32_t pt_asid[MAXCPUS];	/* ASID on each CPU, or 0 */
+	struct cm_mapping *pt_spare;	/* for mmu_map; see mmu_prepare */
+};
+
+/*
+ * Address space IDs.
+ *
+ * Each CPU hands out ASIDs on its own, the first time an address
+ * space runs there, so switching address spaces doesn't need to
+ * flush the TLB. When it runs out it flushes the TLB and starts a
+ * new generation; ASIDs from older generations are then stale and
+ * are replaced when their address space next runs. The generation
+ * count is kept in the bits above the ASID proper, in both
+ * pt_asid[] and asid_last[]. ASID 0 is never handed out.
+ */
+#define ASID_MASK		(NUM_ASID - 1)
+#define ASID_GENERATION(a)	((a) & ~(uint32_t)ASID_MASK)
+
+
+/*
+ * One mapping of a physical page: the page table entry for VA in AS.
+ * mmu_map can't allocate memory, so each page table keeps a spare
+ * for it, refilled by mmu_prepare; mappings that go away are kept on
+ * mapping_freelist for the next refill.
+ */
+struct cm_mapping {
+	struct addrspace *mp_as;
+	vaddr_t mp_va;
+	struct cm_mapping *mp_next;
+};
 
 /*
  * Coremap entry structure.
+ *
+ * Only allocated pages have an lpage or mappings, and only free ones
+ * are on the free lists, so the two share space.
  */
 
 struct coremap_entry {
-	struct lpage *cm_lpage;	/* logical page we hold, or NULL */
-
-	volatile
-	int cm_tlbix:7;		/* tlb index number, or -1 */
-	unsigned cm_cpunum:5;	/* cpu number for cm_tlbix */
+	union {
+		struct {
+			struct lpage *u_lpage;
+			struct cm_mapping *u_maps;
+		} cm_inuse;
+		struct {
+			uint32_t u_nextfree;
+			uint32_t u_prevfree;
+		} cm_free;
+	} cm_u;
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_referenced:1, /* true if mapped since clock hand passed */
+		cm_freehead:1,	/* true if first page of a free block */
+		cm_order:4;	/* if so, log2 of the block's size */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
 };
 
+/* if cm_allocated: */
+#define cm_lpage	cm_u.cm_inuse.u_lpage	/* logical page we hold, or NULL */
+#define cm_maps		cm_u.cm_inuse.u_maps	/* page table entries mapping us */
+/* if cm_freehead: */
+#define cm_nextfree	cm_u.cm_free.u_nextfree	/* free list links */
+#define cm_prevfree	cm_u.cm_free.u_prevfree
+
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
 #define PADDR_TO_COREMAP(page)	(((page)/PAGE_SIZE) - base_coremap_page)
 
@@ -102,12 +185,18 @@ static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * Use one wchan for all page-pin waiting. There shouldn't be that
- * much of it or very many threads at once. Also use one wchan for all
- * TLB shootdown waiting. This is less justifiable - it maybe ought to
- * be per-CPU.
+ * much of it or very many threads at once. TLB shootdown waiting is
+ * per target CPU (see below).
  */
 static struct wchan *coremap_pinchan;
-static struct wchan *coremap_shootchan;
+
+/*
+ * The pageout daemon sleeps on this. Until it's running, the
+ * watermarks are zero and nobody tries to wake it.
+ */
+static struct wchan *coremap_pageoutchan;
+static uint32_t pageout_lowater;
+static uint32_t pageout_hiwater;
 
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
@@ -116,9 +205,70 @@ static uint32_t num_coremap_free;	/* pages not allocated at all */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
+/*
+ * Free pages are kept by a buddy system. Every page that isn't
+ * allocated is in exactly one free block of 2^k pages, for k up to
+ * CM_MAXORDER, whose coremap index is a multiple of 2^k. The first
+ * page of each block is marked with cm_freehead and cm_order and
+ * linked onto coremap_freelists[k] through cm_nextfree/cm_prevfree
+ * (by coremap index; doubly linked so blocks can be taken out of
+ * the middle). When a page is freed it's merged with its buddy, the
+ * block it was split from, as far as possible; so a run of pages for
+ * the kernel can usually be had straight off a list, and free memory
+ * can't stay chopped into single pages.
+ *
+ * Free pages can be pinned (see coremap_alloc_multipages), in which
+ * case they're spoken for and their block is passed over.
+ */
+#define CM_MAXORDER		10	/* blocks of up to 4M */
+#define CM_NOPAGE		((uint32_t)-1)
+static uint32_t coremap_freelists[CM_MAXORDER+1];
+
+/* Unused cm_mappings. Protected by coremap_spinlock. */
+static struct cm_mapping *mapping_freelist;
+
+/*
+ * The zero page: a page of zeros that's mapped read-only wherever a
+ * never-written anonymous page is read (see mmu_map_zero), until the
+ * first write gives it a page of its own. It belongs to the kernel,
+ * so it's never evicted, and the coremap doesn't track its mappings.
+ */
+static paddr_t zero_page;
+
 static volatile uint32_t ct_shootdowns_sent;
+static volatile uint32_t ct_shootdown_batches;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_pageout_wakeups;
+static volatile uint32_t ct_pageout_pages;
+static volatile uint32_t ct_inline_evictions;
+static volatile uint32_t ct_unreferences;
+static volatile uint32_t ct_asid_rollovers;
+static volatile uint32_t ct_zero_maps;
+static volatile uint32_t ct_multipages;
+static volatile uint32_t ct_multipage_evictions;
+
+/*
+ * TLB shootdowns, per target CPU. Requests are queued here by
+ * tlb_shootdown and go out in one IPI per CPU from tlb_shootflush.
+ * Each gets a ticket; shootdown_sent counts those handed out, and
+ * shootdown_done is the last one the CPU has finished. Waiters for a
+ * CPU sleep on its shootdown_chan. A queue count past
+ * TLBSHOOTDOWN_MAX means it overflowed, and the CPU is asked to flush
+ * its whole TLB instead. Protected by coremap_spinlock.
+ */
+static struct tlbshootdown shootdown_queue[MAXCPUS][TLBSHOOTDOWN_MAX];
+static unsigned shootdown_queued[MAXCPUS];
+static uint32_t shootdown_sent[MAXCPUS];
+static uint32_t shootdown_done[MAXCPUS];
+static struct wchan *shootdown_chan[MAXCPUS];
+
+/*
+ * Last ASID handed out on each CPU, with its generation. Kept here
+ * rather than in cpu_vm_machdep because senders of shootdowns check
+ * other CPUs' generations. Protected by coremap_spinlock.
+ */
+static uint32_t asid_last[MAXCPUS];
 
 ////////////////////////////////////////////////////////////
 //
@@ -146,16 +296,35 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sb, sd, si, pw, pp, ie, ur, ar, zm, mp, me;
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
+	sb = ct_shootdown_batches;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	pw = ct_pageout_wakeups;
+	pp = ct_pageout_pages;
+	ie = ct_inline_evictions;
+	ur = ct_unreferences;
+	ar = ct_asid_rollovers;
+	zm = ct_zero_maps;
+	mp = ct_multipages;
+	me = ct_multipage_evictions;
 	spinlock_release(&coremap_spinlock);
 
-	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
-		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: shootdowns: %lu sent in %lu batches, "
+		"%lu done (%lu interrupts)\n",
+		(unsigned long) ss, (unsigned long) sb,
+		(unsigned long) sd, (unsigned long) si);
+	kprintf("vm: pageout: %lu wakeups, %lu pages; %lu inline evictions\n",
+		(unsigned long) pw, (unsigned long) pp, (unsigned long) ie);
+	kprintf("vm: %lu mapped pages unreferenced by the clock hand\n",
+		(unsigned long) ur);
+	kprintf("vm: %lu ASID rollovers\n", (unsigned long) ar);
+	kprintf("vm: %lu zero page mappings\n", (unsigned long) zm);
+	kprintf("vm: %lu multipage allocations, %lu needing eviction\n",
+		(unsigned long) mp, (unsigned long) me);
 }
 
 ////////////////////////////////////////////////////////////
@@ -194,25 +363,8 @@ static
 void
 tlb_invalidate(int tlbix)
 {
-	uint32_t elo, ehi;
-	paddr_t pa;
-	unsigned cmix;
-
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	tlb_read(&ehi, &elo, tlbix);
-	if (elo & TLBLO_VALID) {
-		pa = elo & TLBLO_PPAGE;
-		cmix = PADDR_TO_COREMAP(pa);
-		KASSERT(cmix < num_coremap_entries);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
-		coremap[cmix].cm_tlbix = -1;
-		coremap[cmix].cm_cpunum = 0;
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix));
-	}
-
 	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
 	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
 }
@@ -236,27 +388,134 @@ tlb_clear(void)
 }
 
 /*
- * Do one TLB shootdown.
+ * asid_current: check if ASID (with its generation) is still in use
+ * on CPU, so the TLB there may have entries tagged with it.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
+static
+bool
+asid_current(unsigned cpu, uint32_t asid)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	return (asid & ASID_MASK) != 0 &&
+		ASID_GENERATION(asid) == ASID_GENERATION(asid_last[cpu]);
+}
+
+/*
+ * asid_alloc: Hand out a fresh ASID (with its generation) on this CPU.
+ * If we've run out, start a new generation; that requires flushing
+ * the TLB, since it may have entries for any of the old ASIDs.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+asid_alloc(void)
+{
+	unsigned me = curcpu->c_number;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	asid_last[me]++;
+	if ((asid_last[me] & ASID_MASK) == 0) {
+		tlb_clear();
+		ct_asid_rollovers++;
+		/* skip ASID 0 */
+		asid_last[me]++;
+	}
+	return asid_last[me];
+}
+
+/*
+ * tlb_unmap: Searches the TLB for a vaddr translation with the given
+ * ASID and invalidates it if it exists.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block. 
+ */
+static
 void
-vm_tlbshootdown(const struct tlbshootdown *ts, int num)
+tlb_unmap(vaddr_t va, uint32_t asid)
 {
 	int i;
-	int tlbix;
-	unsigned where;
+	uint32_t elo = 0, ehi = 0;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	KASSERT(va < MIPS_KSEG0);
+	KASSERT(asid != 0 && asid < NUM_ASID);
+
+	i = tlb_probe((va & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i < 0) {
+		return;
+	}
+	
+	tlb_read(&ehi, &elo, i);
+	
+	KASSERT(elo & TLBLO_VALID);
+	
+	DEBUG(DB_TLB, "invalidating tlb slot %d (va: 0x%x)\n", i, va); 
+	
+	tlb_invalidate(i);
+}
+
+/*
+ * shootdown_finished: note that this CPU has done the shootdowns up
+ * to TICKET, and wake anyone waiting for them. Batches can be
+ * overtaken by a flush of the whole TLB, so don't go backwards.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+shootdown_finished(uint32_t ticket)
+{
+	unsigned me = curcpu->c_number;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if ((int32_t)(ticket - shootdown_done[me]) > 0) {
+		shootdown_done[me] = ticket;
+	}
+	wchan_wakeall(shootdown_chan[me]);
+}
+
+/*
+ * tlb_doshootdowns: do a batch of shootdowns aimed at this CPU.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_doshootdowns(const struct tlbshootdown *ts, unsigned num)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	spinlock_acquire(&coremap_spinlock);
-	ct_shootdown_interrupts++;
 	for (i=0; i<num; i++) {
-		tlbix = ts[i].ts_tlbix;
-		where = ts[i].ts_coremapindex;
-		if (coremap[where].cm_tlbix == tlbix &&
-		    coremap[where].cm_cpunum == curcpu->c_number) {
-			tlb_invalidate(tlbix);
+		/* If the ASID is stale, the TLB has been flushed since. */
+		if (asid_current(curcpu->c_number, ts[i].ts_asid)) {
+			tlb_unmap(ts[i].ts_vaddr, ts[i].ts_asid & ASID_MASK);
 			ct_shootdowns_done++;
 		}
 	}
-	wchan_wakeall(coremap_shootchan);
+	if (num > 0) {
+		/* Requests are queued in ticket order. */
+		shootdown_finished(ts[num-1].ts_ticket);
+	}
+}
+
+/*
+ * Do a batch of TLB shootdowns.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts, int num)
+{
+	spinlock_acquire(&coremap_spinlock);
+	ct_shootdown_interrupts++;
+	tlb_doshootdowns(ts, num);
 	spinlock_release(&coremap_spinlock);
 }
 
@@ -270,52 +529,230 @@ vm_tlbshootdown_all(void)
 	ct_shootdown_interrupts++;
 	tlb_clear();
 	ct_shootdowns_done += NUM_TLB;
-	wchan_wakeall(coremap_shootchan);
+	/* That takes care of everything anyone has asked for. */
+	shootdown_finished(shootdown_sent[curcpu->c_number]);
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * Wait for shootdown to complete.
+ * Wait for CPU to do some shootdowns.
  */
 static
 void
-tlb_shootwait(void)
+tlb_shootwait(unsigned cpu)
 {
-	wchan_lock(coremap_shootchan);
+	wchan_lock(shootdown_chan[cpu]);
 	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_shootchan);
+	wchan_sleep(shootdown_chan[cpu]);
 	spinlock_acquire(&coremap_spinlock);
 }
 
 /*
- * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
- * it if it exists.
+ * tlb_shootdown: remove any TLB entry for VA in address space AS,
+ * on every CPU. The page table entry must already be gone, so the
+ * refill code can't load it again.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block. 
+ * TLB entries are tagged with ASIDs and survive switching address
+ * spaces, so any CPU where AS has an ASID of the current generation
+ * may have entries for it, whether or not AS is running there now.
+ * We do our own TLB directly; for the others we queue a shootdown
+ * naming the ASID to hit. Nothing is sent until tlb_shootflush, so
+ * that several pages can go out in one IPI; the caller must call it
+ * before letting go of the page.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
 void
-tlb_unmap(vaddr_t va)
+tlb_shootdown(struct addrspace *as, vaddr_t va)
 {
-	int i;
-	uint32_t elo = 0, ehi = 0;
+	struct pagetable *pt = as->as_pagetable;
+	struct tlbshootdown *ts;
+	unsigned i, n;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	KASSERT(va < MIPS_KSEG0);
+	for (i=0; i<MAXCPUS; i++) {
+		if (!asid_current(i, pt->pt_asid[i])) {
+			continue;
+		}
+		if (i == curcpu->c_number) {
+			tlb_unmap(va, pt->pt_asid[i] & ASID_MASK);
+			continue;
+		}
 
-	i = tlb_probe(va & PAGE_FRAME,0);
-	if (i < 0) {
-		return;
+		/* yay, TLB shootdown */
+		n = shootdown_queued[i];
+		if (n < TLBSHOOTDOWN_MAX) {
+			ts = &shootdown_queue[i][n];
+			ts->ts_asid = pt->pt_asid[i];
+			ts->ts_vaddr = va;
+			ts->ts_ticket = shootdown_sent[i] + 1;
+			shootdown_queued[i] = n + 1;
+		}
+		else {
+			/* overflowed; the whole TLB will be flushed */
+			shootdown_queued[i] = TLBSHOOTDOWN_MAX + 1;
+		}
+		shootdown_sent[i]++;
+		ct_shootdowns_sent++;
+	}
+}
+
+/*
+ * tlb_shootflush: send out the queued shootdowns, one IPI per target
+ * CPU, and sleep until every shootdown queued so far is done. This
+ * includes other threads' requests, which may have been sent already
+ * along with ours.
+ *
+ * Shootdowns queued by pt_unreference can wait for whoever flushes
+ * next, which may be a thread on the very CPU they're aimed at. That
+ * CPU's queue is just done here.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May block.
+ */
+static
+void
+tlb_shootflush(void)
+{
+	uint32_t tickets[MAXCPUS];
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<MAXCPUS; i++) {
+		tickets[i] = shootdown_sent[i];
+		if (shootdown_queued[i] == 0) {
+			continue;
+		}
+		if (i == curcpu->c_number) {
+			if (shootdown_queued[i] > TLBSHOOTDOWN_MAX) {
+				tlb_clear();
+				shootdown_finished(shootdown_sent[i]);
+			}
+			else {
+				tlb_doshootdowns(shootdown_queue[i],
+						 shootdown_queued[i]);
+			}
+			shootdown_queued[i] = 0;
+			continue;
+		}
+		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+		ipi_tlbshootdown(i, shootdown_queue[i], shootdown_queued[i]);
+		shootdown_queued[i] = 0;
+		ct_shootdown_batches++;
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		while ((int32_t)(shootdown_done[i] - tickets[i]) < 0) {
+			tlb_shootwait(i);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Page tables
+
+/*
+ * pt_lookup: find the page table entry for VA in PT. Returns NULL if
+ * there's no second-level table for it; see mmu_prepare.
+ *
+ * Synchronization: assumes we hold coremap_spinlock, unless PT
+ * belongs to the caller. Does not block.
+ */
+static
+uint32_t *
+pt_lookup(struct pagetable *pt, vaddr_t va)
+{
+	uint32_t *l2;
+
+	KASSERT(va < USERSPACETOP);
+
+	l2 = pt->pt_l2[va >> PT_L1SHIFT];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return &l2[(va >> PT_L2SHIFT) & (PT_L2SIZE - 1)];
+}
+
+/*
+ * pt_mapentry: find the page table entry that mapping MP of the page
+ * at coremap index WHERE refers to.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t *
+pt_mapentry(int where, struct cm_mapping *mp)
+{
+	uint32_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	pte = pt_lookup(mp->mp_as->as_pagetable, mp->mp_va);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & TLBLO_PPAGE) == COREMAP_TO_PADDR(where));
+	return pte;
+}
+
+/*
+ * pt_unmap_page: remove every mapping of the page at coremap index
+ * WHERE, from the page tables and from every TLB. This may take
+ * shootdowns, which the caller must finish with tlb_shootflush; the
+ * page must stay pinned until then.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pt_unmap_page(int where)
+{
+	struct cm_mapping *mp;
+	uint32_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	while ((mp = coremap[where].cm_maps) != NULL) {
+		pte = pt_mapentry(where, mp);
+		*pte = 0;
+		tlb_shootdown(mp->mp_as, mp->mp_va);
+
+		coremap[where].cm_maps = mp->mp_next;
+		mp->mp_next = mapping_freelist;
+		mapping_freelist = mp;
+
+		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+		      (unsigned long) COREMAP_TO_PADDR(where));
+	}
+}
+
+/*
+ * pt_protect_page: make every mapping of the page at coremap index
+ * WHERE read-only, so the next write to it faults. Entries already in
+ * a TLB are shot down; as for pt_unmap_page, the caller must finish
+ * with tlb_shootflush, with the page pinned.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pt_protect_page(int where)
+{
+	struct cm_mapping *mp;
+	uint32_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	for (mp = coremap[where].cm_maps; mp != NULL; mp = mp->mp_next) {
+		pte = pt_mapentry(where, mp);
+		if (*pte & TLBLO_DIRTY) {
+			*pte &= ~(uint32_t)TLBLO_DIRTY;
+			tlb_shootdown(mp->mp_as, mp->mp_va);
+		}
 	}
-	
-	tlb_read(&ehi, &elo, i);
-	
-	KASSERT(elo & TLBLO_VALID);
-	
-	DEBUG(DB_TLB, "invalidating tlb slot %d (va: 0x%x)\n", i, va); 
-	
-	tlb_invalidate(i);
 }
 
 /*
@@ -347,7 +784,8 @@ mipstlb_getslot(void)
  * To evict a page, it must be non-kernel and non-pinned.
  *
  * page_replace() takes no arguments and returns an index into the
- * coremap (for the selected victim page).
+ * coremap (for the selected victim page), or -1 if every candidate
+ * is busy (pinned) right now.
  */
 
 #if OPT_RANDPAGE
@@ -357,35 +795,237 @@ mipstlb_getslot(void)
  *
  * Repeatedly generates a random index into the coremap until the 
  * selected page is not pinned and does not belong to the kernel.
+ * Gives up after as many tries as there are pages.
  */
 static
-uint32_t 
+int
 page_replace(void)
 {
-    // Complete this function.
-	return 0;
+	uint32_t where, tries;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (tries = 0; tries < num_coremap_entries; tries++) {
+		where = random() % num_coremap_entries;
+		if (!coremap[where].cm_pinned && !coremap[where].cm_kernel) {
+			return where;
+		}
+	}
+	return -1;
 }
 
 #else /* not OPT_RANDPAGE */
 
 /*
- * Sequential page replacement.
+ * Clock (second-chance) page replacement.
+ *
+ * The hand sweeps the coremap, skipping pages that are pinned or that
+ * belong to the kernel. A page referenced since the hand last came by
+ * has its reference bit cleared and is passed over; the first page
+ * found unreferenced is the victim.
+ *
+ * The MIPS has no hardware reference bit. Instead mmu_map sets
+ * cm_referenced whenever a page is entered in the page table and the
+ * TLB. When the hand clears the bit it also marks the page table entry
+ * not valid, so the refill code can't load it without us noticing,
+ * and shoots the page down, so that if it's still in use it faults,
+ * and gets marked, again.
  *
- * Selects pages to be evicted from the coremap sequentially. Skips
- * pages that are pinned or that belong to the kernel.
+ * Every page gets its second chance on the first turn, so gives up
+ * after two full turns.
  */
 
+/*
+ * pt_unreference: called by the clock hand after clearing a page's
+ * reference bit. Makes the page's page table entries not valid (but
+ * keeps the mappings) so that the next TLB miss on any of them takes
+ * the slow path, through mmu_map, which sets the reference bit again.
+ * Entries already in a TLB are shot down. This is only a hint, so the
+ * shootdowns are just queued; they go out with the next tlb_shootflush.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
 static
-uint32_t
+void
+pt_unreference(int where)
+{
+	struct cm_mapping *mp;
+	uint32_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (mp = coremap[where].cm_maps; mp != NULL; mp = mp->mp_next) {
+		pte = pt_mapentry(where, mp);
+		*pte &= ~(uint32_t)TLBLO_VALID;
+		tlb_shootdown(mp->mp_as, mp->mp_va);
+		ct_unreferences++;
+	}
+}
+
+static uint32_t clock_hand;
+
+static
+int
 page_replace(void)
 {
-	// Complete this function.
-	return 0;
+	struct coremap_entry *cme;
+	uint32_t tries;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (tries = 0; tries < 2*num_coremap_entries; tries++) {
+		clock_hand = (clock_hand + 1) % num_coremap_entries;
+		cme = &coremap[clock_hand];
+
+		if (cme->cm_pinned || cme->cm_kernel) {
+			continue;
+		}
+		if (!cme->cm_allocated) {
+			/* free page; nothing to evict */
+			return clock_hand;
+		}
+		if (cme->cm_referenced) {
+			cme->cm_referenced = 0;
+			pt_unreference(clock_hand);
+			continue;
+		}
+		return clock_hand;
+	}
+	return -1;
 }
 
 #endif /* OPT_RANDPAGE */
 
 
+////////////////////////////////////////////////////////////
+//
+// Free blocks
+//
+
+/*
+ * freelist_add: put the free block of 2^ORDER pages at IX on the
+ * front of its free list.
+ */
+static
+void
+freelist_add(uint32_t ix, unsigned order)
+{
+	uint32_t head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(order <= CM_MAXORDER);
+	KASSERT((ix & ((1U << order) - 1)) == 0);
+	KASSERT(coremap[ix].cm_allocated == 0);
+	KASSERT(coremap[ix].cm_freehead == 0);
+
+	head = coremap_freelists[order];
+	coremap[ix].cm_freehead = 1;
+	coremap[ix].cm_order = order;
+	coremap[ix].cm_prevfree = CM_NOPAGE;
+	coremap[ix].cm_nextfree = head;
+	if (head != CM_NOPAGE) {
+		coremap[head].cm_prevfree = ix;
+	}
+	coremap_freelists[order] = ix;
+}
+
+/*
+ * freelist_remove: take the free block at IX off its free list.
+ */
+static
+void
+freelist_remove(uint32_t ix)
+{
+	uint32_t next, prev;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[ix].cm_freehead);
+
+	next = coremap[ix].cm_nextfree;
+	prev = coremap[ix].cm_prevfree;
+	if (prev == CM_NOPAGE) {
+		KASSERT(coremap_freelists[coremap[ix].cm_order] == ix);
+		coremap_freelists[coremap[ix].cm_order] = next;
+	}
+	else {
+		coremap[prev].cm_nextfree = next;
+	}
+	if (next != CM_NOPAGE) {
+		coremap[next].cm_prevfree = prev;
+	}
+	coremap[ix].cm_freehead = 0;
+	coremap[ix].cm_nextfree = CM_NOPAGE;
+	coremap[ix].cm_prevfree = CM_NOPAGE;
+}
+
+/*
+ * buddy_free: add the newly free page IX to the free blocks, merging
+ * it with its buddy, and the result with its buddy, and so on.
+ */
+static
+void
+buddy_free(uint32_t ix)
+{
+	uint32_t buddy;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (order = 0; order < CM_MAXORDER; order++) {
+		buddy = ix ^ (1U << order);
+		if (buddy + (1U << order) > num_coremap_entries ||
+		    !coremap[buddy].cm_freehead ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		ix &= buddy;
+	}
+	freelist_add(ix, order);
+}
+
+/*
+ * buddy_take: take the free page IX out of the free blocks, about to
+ * be allocated. The block it's in is split in half repeatedly, and
+ * the halves it isn't in go back on the free lists.
+ */
+static
+void
+buddy_take(uint32_t ix)
+{
+	uint32_t start, half;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[ix].cm_allocated == 0);
+
+	/* Find the block; it's the smallest aligned one with a head. */
+	start = ix;
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		start = ix & ~((1U << order) - 1);
+		if (coremap[start].cm_freehead &&
+		    coremap[start].cm_order == order) {
+			break;
+		}
+	}
+	KASSERT(order <= CM_MAXORDER);
+
+	freelist_remove(start);
+	while (order > 0) {
+		order--;
+		half = 1U << order;
+		if (ix >= start + half) {
+			freelist_add(start, order);
+			start += half;
+		}
+		else {
+			freelist_add(start + half, order);
+		}
+	}
+	KASSERT(start == ix);
+}
+
+
 ////////////////////////////////////////////////////////////
 //
 // Setup/initialization
@@ -414,6 +1054,8 @@ coremap_bootstrap(void)
 	uint32_t i;
 	paddr_t first, last;
 	uint32_t npages, coremapsize;
+	unsigned order;
+	vaddr_t va;
 
 	ram_getsize(&first, &last);
 
@@ -473,17 +1115,48 @@ coremap_bootstrap(void)
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
 		coremap[i].cm_pinned = 0;
-		coremap[i].cm_tlbix = -1;
-		coremap[i].cm_cpunum = 0;
-		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_freehead = 0;
+		coremap[i].cm_order = 0;
 	}
 
+	/*
+	 * Cut all the pages up into free blocks, each as big as its
+	 * alignment and what's left allow.
+	 */
+	for (i=0; i <= CM_MAXORDER; i++) {
+		coremap_freelists[i] = CM_NOPAGE;
+	}
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i < num_coremap_entries; i += 1U << order) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       (i & ((2U << order) - 1)) == 0 &&
+		       i + (2U << order) <= num_coremap_entries) {
+			order++;
+		}
+		freelist_add(i, order);
+	}
+	spinlock_release(&coremap_spinlock);
+
 	coremap_pinchan = wchan_create("vmpin");
-	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
+	if (coremap_pinchan == NULL) {
 		panic("Failed allocating coremap wchans\n");
 	}
+	for (i=0; i<MAXCPUS; i++) {
+		shootdown_chan[i] = wchan_create("tlbshoot");
+		if (shootdown_chan[i] == NULL) {
+			panic("Failed allocating coremap wchans\n");
+		}
+	}
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		panic("vm: Failed allocating the zero page\n");
+	}
+	bzero((char *)va, PAGE_SIZE);
+	zero_page = KVADDR_TO_PADDR(va);
 }	
 
 ////////////////////////////////////////////////////////////
@@ -506,15 +1179,20 @@ piggish_kernel(int proposed_kernel_pages)
 	return 0;
 }
 
+/*
+ * do_evict_start: pin a page we're about to evict and start getting
+ * it out of every TLB. Once the caller has done tlb_shootflush nobody
+ * can touch it through a mapping, so the lpage can be written out at
+ * leisure.
+ */
 static
 void
-do_evict(int where)
+do_evict_start(int where)
 {
 	struct lpage *lp;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_allocated);
@@ -529,57 +1207,112 @@ do_evict(int where)
 	 */
 	coremap[where].cm_pinned = 1;
 
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
-		}
-		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
-		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
-	}
+	pt_unmap_page(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
 	/* properly we ought to lock the lpage to test this */
 	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
+}
 
-	/* release the coremap spinlock in case we need to swap out */
-	spinlock_release(&coremap_spinlock);
-
-	lpage_evict(lp);
-
-	spinlock_acquire(&coremap_spinlock);
+/*
+ * do_evict_finish: mark a page evicted by do_evict_start and
+ * lpage_evict as free.
+ */
+static
+void
+do_evict_finish(int where, struct lpage *lp)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
 	/* because the page is pinned these shouldn't have changed */
 	KASSERT(coremap[where].cm_allocated == 1);
 	KASSERT(coremap[where].cm_lpage == lp);
 	KASSERT(coremap[where].cm_pinned == 1);
 
+	KASSERT(coremap[where].cm_maps == NULL);
+
 	coremap[where].cm_allocated = 0;
 	coremap[where].cm_lpage = NULL;
 	coremap[where].cm_pinned = 0;
+	buddy_free(where);
 
 	num_coremap_user--;
 	num_coremap_free++;
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
 	       == num_coremap_entries);
+}
+
+static
+void
+do_evict(int where)
+{
+	struct lpage *lp;
+
+	lp = coremap[where].cm_lpage;
+	do_evict_start(where);
+	tlb_shootflush();
+
+	/* release the coremap spinlock in case we need to swap out */
+	spinlock_release(&coremap_spinlock);
+
+	lpage_evict(lp);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	do_evict_finish(where, lp);
 
 	wchan_wakeall(coremap_pinchan);
 }
 
+/*
+ * do_evict_cluster: evict several pages, so the dirty ones can be
+ * written to swap together.
+ */
+static
+void
+do_evict_cluster(const int *where, unsigned n)
+{
+	struct lpage *lps[SWAP_MAXCLUSTER];
+	unsigned i;
+
+	KASSERT(n > 0 && n <= SWAP_MAXCLUSTER);
+
+	/* The pages were pinned by do_evict_start as they were chosen. */
+	for (i=0; i<n; i++) {
+		KASSERT(coremap[where[i]].cm_pinned == 1);
+		lps[i] = coremap[where[i]].cm_lpage;
+	}
+
+	spinlock_release(&coremap_spinlock);
+
+	lpage_evict_cluster(lps, n);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	for (i=0; i<n; i++) {
+		do_evict_finish(where[i], lps[i]);
+	}
+
+	wchan_wakeall(coremap_pinchan);
+}
+
+/*
+ * coremap_pinwait: wait for a pinned page to unpin.
+ */
+static
+void
+coremap_pinwait(void)
+{
+	wchan_lock(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+	wchan_sleep(coremap_pinchan);
+	spinlock_acquire(&coremap_spinlock);
+}
+
+/*
+ * do_page_replace: pick a victim and evict it. Returns the index of
+ * the page, now free, or -1 if everything evictable is busy.
+ */
 static
 int
 do_page_replace(void)
@@ -587,9 +1320,13 @@ do_page_replace(void)
 	int where;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	where = page_replace();
+	if (where < 0) {
+		/* Send any shootdowns pt_unreference queued. */
+		tlb_shootflush();
+		return -1;
+	}
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_kernel==0);
@@ -603,6 +1340,141 @@ do_page_replace(void)
 	return where;
 }
 
+/*
+ * pageout_wakeup: kick the pageout daemon if free memory is getting
+ * low. Callable from anywhere, including interrupt handlers.
+ */
+static
+void
+pageout_wakeup(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (num_coremap_free < pageout_lowater) {
+		wchan_wakeone(coremap_pageoutchan);
+	}
+}
+
+/*
+ * pageout_choose: pick up to MAX resident user pages to evict,
+ * starting their eviction as we go (which pins them, so page_replace
+ * won't pick them twice). Returns the number chosen.
+ */
+static
+unsigned
+pageout_choose(int *where, unsigned max)
+{
+	unsigned n, tries;
+	int victim;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(max <= SWAP_MAXCLUSTER);
+
+	n = 0;
+	for (tries = 0; n < max && tries < num_coremap_entries; tries++) {
+		victim = page_replace();
+		if (victim < 0) {
+			break;
+		}
+		KASSERT(coremap[victim].cm_pinned==0);
+		KASSERT(coremap[victim].cm_kernel==0);
+		if (!coremap[victim].cm_allocated) {
+			continue;
+		}
+		do_evict_start(victim);
+		where[n++] = victim;
+	}
+
+	/* Shoot them all down at once. */
+	tlb_shootflush();
+	return n;
+}
+
+/*
+ * pageout_thread: the pageout daemon.
+ *
+ * Sleeps until free memory drops below the low watermark, then evicts
+ * pages in clusters (so the dirty ones go to swap in one disk write
+ * each) until it's back above the high watermark.
+ */
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	int where[SWAP_MAXCLUSTER];
+	unsigned n, want;
+	bool stuck;
+
+	(void)data1;
+	(void)data2;
+
+	stuck = false;
+	while (1) {
+		/*
+		 * If the last round found nothing to evict (everything
+		 * is pinned or kernel), wait for the next wakeup rather
+		 * than spinning.
+		 */
+		spinlock_acquire(&coremap_spinlock);
+		while (stuck || num_coremap_free >= pageout_lowater) {
+			wchan_lock(coremap_pageoutchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(coremap_pageoutchan);
+			spinlock_acquire(&coremap_spinlock);
+			stuck = false;
+		}
+		ct_pageout_wakeups++;
+
+		while (num_coremap_free < pageout_hiwater) {
+			want = pageout_hiwater - num_coremap_free;
+			if (want > SWAP_MAXCLUSTER) {
+				want = SWAP_MAXCLUSTER;
+			}
+			n = pageout_choose(where, want);
+			if (n == 0) {
+				stuck = true;
+				break;
+			}
+			do_evict_cluster(where, n);
+			ct_pageout_pages += n;
+		}
+		spinlock_release(&coremap_spinlock);
+	}
+}
+
+/*
+ * pageout_bootstrap: start the pageout daemon. Needs threads and
+ * process IDs, so it runs late in boot.
+ */
+void
+pageout_bootstrap(void)
+{
+	uint32_t lowater;
+	int result;
+
+	lowater = num_coremap_entries / CM_LOWATER_FRAC;
+	if (lowater < CM_LOWATER_MIN) {
+		lowater = CM_LOWATER_MIN;
+	}
+
+	coremap_pageoutchan = wchan_create("pageout");
+	if (coremap_pageoutchan == NULL) {
+		panic("pageout_bootstrap: Out of memory\n");
+	}
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("pageout_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	pageout_lowater = lowater;
+	pageout_hiwater = 2 * lowater;
+	pageout_wakeup();
+	spinlock_release(&coremap_spinlock);
+}
+
 static
 void
 mark_pages_allocated(int start, int npages, int dopin, int iskern)
@@ -614,31 +1486,83 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		KASSERT(coremap[i].cm_pinned==0);
 		KASSERT(coremap[i].cm_allocated==0);
 		KASSERT(coremap[i].cm_kernel==0);
-		KASSERT(coremap[i].cm_lpage==NULL);
-		KASSERT(coremap[i].cm_tlbix<0);
-		KASSERT(coremap[i].cm_cpunum == 0);
 
+		buddy_take(i);
+		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_maps = NULL;
 		if (dopin) {
 			coremap[i].cm_pinned = 1;
 		}
 		coremap[i].cm_allocated = 1;
+		coremap[i].cm_referenced = 0;
 		if (iskern) {
 			coremap[i].cm_kernel = 1;
 		}
 
-		if (i < start+npages-1) {
-			coremap[i].cm_notlast = 1;
+		if (i < start+npages-1) {
+			coremap[i].cm_notlast = 1;
+		}
+	}
+	if (iskern) {
+		num_coremap_kernel += npages;
+	}
+	else {
+		num_coremap_user += npages;
+	}
+	num_coremap_free -= npages;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+}
+
+/*
+ * coremap_find_free: return the index of the start of a free block
+ * big enough for NPAGES pages, taking the smallest that will do, or
+ * -1 if there isn't one. Pages that are free but pinned are spoken
+ * for; there are only ever a few of those (see
+ * coremap_alloc_multipages), so skipping them is quick.
+ *
+ * The pages stay in the free block; mark_pages_allocated takes them
+ * out, splitting it up and leaving what's left over free.
+ */
+static
+int
+coremap_find_free(unsigned npages)
+{
+	unsigned order, j;
+	uint32_t i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(npages > 0);
+
+	if (num_coremap_free < npages) {
+		return -1;
+	}
+
+	for (order = 0; (1U << order) < npages; order++) {
+		if (order == CM_MAXORDER) {
+			/* bigger than any block */
+			return -1;
 		}
 	}
-	if (iskern) {
-		num_coremap_kernel += npages;
-	}
-	else {
-		num_coremap_user += npages;
+
+	for (; order <= CM_MAXORDER; order++) {
+		for (i = coremap_freelists[order]; i != CM_NOPAGE;
+		     i = coremap[i].cm_nextfree) {
+			KASSERT(coremap[i].cm_freehead);
+			KASSERT(coremap[i].cm_order == order);
+			for (j=0; j<npages; j++) {
+				KASSERT(coremap[i+j].cm_allocated==0);
+				if (coremap[i+j].cm_pinned) {
+					break;
+				}
+			}
+			if (j == npages) {
+				return i;
+			}
+		}
 	}
-	num_coremap_free -= npages;
-	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	/* The free pages are chopped up or reserved. */
+	return -1;
 }
 
 /*
@@ -647,70 +1571,55 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
  * Allocate one page of memory, mark it pinned if requested, and
  * return its paddr. The page is marked a kernel page iff the lp
  * argument is NULL.
+ *
+ * Normally the pageout daemon keeps some pages free and this just
+ * takes one. If there are none we evict a page ourselves. (But we
+ * can't if we're in an interrupt, or if we're still very early in
+ * boot.) If every evictable page is busy, wait for one to unpin.
  */
 static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern, cansleep;
 
 	iskern = (lp == NULL);
-
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
+	cansleep = (curthread != NULL && !curthread->t_in_interrupt);
 
 	spinlock_acquire(&coremap_spinlock);
 
-	/*
-	 * Don't allow the kernel to eat everything.
-	 */
-	if (iskern && piggish_kernel(1)) {
-		coremap_print_short();
-		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
+	while (1) {
+		/*
+		 * Don't allow the kernel to eat everything.
+		 */
+		if (iskern && piggish_kernel(1)) {
+			coremap_print_short();
+			spinlock_release(&coremap_spinlock);
+			kprintf("alloc_kpages: kernel heap full getting 1 page\n");
+			return INVALID_PADDR;
 		}
-		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
-		return INVALID_PADDR;
-	}
-
-	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
-	 */
-
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
 
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
+		/*
+		 * Take a single page if there is one, so as not to break
+		 * up bigger blocks.
+		 */
+		candidate = coremap_find_free(1);
+		if (candidate >= 0 || !cansleep) {
 			break;
 		}
-	}
 
-	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
-		KASSERT(num_coremap_free==0);
 		candidate = do_page_replace();
+		if (candidate >= 0) {
+			ct_inline_evictions++;
+			break;
+		}
+
+		coremap_pinwait();
 	}
 
 	if (candidate < 0) {
+		pageout_wakeup();
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
 		return INVALID_PADDR;
 	}
 
@@ -718,14 +1627,12 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	mark_pages_allocated(candidate, 1 /* npages */, dopin, iskern);
 	coremap[candidate].cm_lpage = lp;
 
-	// free pages should not be in the TLB
-	KASSERT(coremap[candidate].cm_tlbix < 0);
-	KASSERT(coremap[candidate].cm_cpunum == 0);
+	// free pages should not be mapped
+	KASSERT(coremap[candidate].cm_maps == NULL);
+
+	pageout_wakeup();
 
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 
 	return COREMAP_TO_PADDR(candidate);
 }
@@ -736,35 +1643,34 @@ coremap_alloc_multipages(unsigned npages)
 {
 	int base, bestbase;
 	int badness, bestbadness;
-	int evicted;
-	unsigned i;
+	int busy;
+	unsigned i, j;
 
 	KASSERT(npages>1);
 
-	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
-	 */
-
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
-
 	spinlock_acquire(&coremap_spinlock);
 
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
 		return INVALID_PADDR;
 	}
+	ct_multipages++;
+
+	/* Normally there's a free block that will do. */
+	bestbase = coremap_find_free(npages);
+	if (bestbase >= 0) {
+		mark_pages_allocated(bestbase, npages, 0 /* dopin */,
+				     1 /* kernel */);
+		spinlock_release(&coremap_spinlock);
+		return COREMAP_TO_PADDR(bestbase);
+	}
+	ct_multipage_evictions++;
 
 	/*
+	 * Otherwise we need to make room by evicting user pages.
 	 * Look for the best block of this length.
 	 * "badness" counts how many evictions we need to do.
 	 * Find the block where it's smallest.
@@ -816,51 +1722,54 @@ coremap_alloc_multipages(unsigned npages)
 		if (bestbase < 0) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
-			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
-			}
 			return INVALID_PADDR;
 		}
 
 		/*
-		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * Evict whatever is in the range. Pin each page as it
+		 * becomes free so nobody else allocates it while we're
+		 * off evicting the rest. If some page in the range got
+		 * pinned or taken by the kernel while we weren't looking,
+		 * let go of what we have and try the whole schmear again.
 		 */
 
-		evicted = 0;
+		busy = 0;
 		for (i=bestbase; i<bestbase+npages; i++) {
 			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
-				/* Whoops... retry */
-				KASSERT(evicted==1);
+				busy = 1;
 				break;
 			}
 			if (coremap[i].cm_allocated) {
 				if (curthread == NULL ||
 				    curthread->t_in_interrupt) {
 					/* Can't evict here */
-					spinlock_release(&coremap_spinlock);
-					/* don't need to unlock */
-					return INVALID_PADDR;
+					busy = -1;
+					break;
 				}
 				do_evict(i);
-				evicted = 1;
 			}
+			KASSERT(coremap[i].cm_allocated == 0);
+			KASSERT(coremap[i].cm_pinned == 0);
+			coremap[i].cm_pinned = 1;
+		}
+
+		for (j=bestbase; j<i; j++) {
+			coremap[j].cm_pinned = 0;
+		}
+		if (busy) {
+			wchan_wakeall(coremap_pinchan);
+		}
+		if (busy < 0) {
+			spinlock_release(&coremap_spinlock);
+			return INVALID_PADDR;
 		}
-	} while (evicted);
+	} while (busy);
 
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
 			     1 /* kernel */);
 				     
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 	return COREMAP_TO_PADDR(bestbase);
 }
 
@@ -880,6 +1789,45 @@ coremap_allocuser(struct lpage *lp)
 	return coremap_alloc_one_page(lp, 1 /* dopin */);
 }
 
+/*
+ * coremap_allocuser_spare
+ *
+ * Like coremap_allocuser, but for speculative allocations (swap
+ * prefetch): only hands out a page that is already free, never evicts,
+ * and leaves the pageout daemon's reserve alone. Returns INVALID_PADDR
+ * if there's nothing to spare. The page comes back pinned.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+paddr_t
+coremap_allocuser_spare(struct lpage *lp)
+{
+	int candidate;
+
+	KASSERT(lp != NULL);
+
+	spinlock_acquire(&coremap_spinlock);
+	if (num_coremap_free <= pageout_lowater) {
+		spinlock_release(&coremap_spinlock);
+		return INVALID_PADDR;
+	}
+
+	candidate = coremap_find_free(1);
+	if (candidate < 0) {
+		spinlock_release(&coremap_spinlock);
+		return INVALID_PADDR;
+	}
+
+	mark_pages_allocated(candidate, 1 /* npages */, 1 /* dopin */,
+			     0 /* iskern */);
+	coremap[candidate].cm_lpage = lp;
+
+	pageout_wakeup();
+	spinlock_release(&coremap_spinlock);
+
+	return COREMAP_TO_PADDR(candidate);
+}
+
 /*
  * coremap_free 
  *
@@ -913,17 +1861,15 @@ coremap_free(paddr_t page, bool iskern)
 		 */
 		KASSERT(iskern || coremap[i].cm_pinned);
 
-		/* flush any live mapping */
-		if (coremap[i].cm_tlbix >= 0) {
-			/* should only release one's own pages */
-			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
-
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
-
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
+		/*
+		 * Flush any live mappings. A page that was shared
+		 * copy-on-write may still be mapped by its other
+		 * owners.
+		 */
+		if (coremap[i].cm_maps != NULL) {
+			KASSERT(!coremap[i].cm_kernel);
+			pt_unmap_page(i);
+			tlb_shootflush();
 		}
 
 		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
@@ -931,7 +1877,7 @@ coremap_free(paddr_t page, bool iskern)
 
 		/* now we can actually deallocate the page */
 
-		coremap[i].cm_allocated = 0;
+		KASSERT(coremap[i].cm_maps == NULL);
 		if (coremap[i].cm_kernel) {
 			KASSERT(coremap[i].cm_lpage == NULL);
 			num_coremap_kernel--;
@@ -945,7 +1891,10 @@ coremap_free(paddr_t page, bool iskern)
 		}
 		num_coremap_free++;
 
+		/* The lpage field goes to the free list links now. */
 		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_allocated = 0;
+		buddy_free(i);
 
 		if (!coremap[i].cm_notlast) {
 			break;
@@ -962,6 +1911,8 @@ coremap_free(paddr_t page, bool iskern)
  *
  * Allocate some kernel-space virtual pages.
  * This is the interface kmalloc uses to get pages for its use.
+ * If there are none, has kmalloc give back what its magazines are
+ * holding (kheap_reclaim) and tries once more.
  *
  * Synchronization: takes coremap_spinlock.
  * May block to swap pages out.
@@ -970,6 +1921,9 @@ vaddr_t
 alloc_kpages(int npages)
 {
 	paddr_t pa;
+	bool reclaimed = false;
+
+ again:
 	if (npages > 1) {
 		pa = coremap_alloc_multipages(npages);
 	}
@@ -977,6 +1931,16 @@ alloc_kpages(int npages)
 		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
 	}
 	if (pa==INVALID_PADDR) {
+		if (!reclaimed) {
+			/*
+			 * kmalloc's magazines may be holding enough free
+			 * blocks to make up whole pages; have it give
+			 * them back and try once more.
+			 */
+			kheap_reclaim();
+			reclaimed = true;
+			goto again;
+		}
 		return 0;
 	}
 	return PADDR_TO_KVADDR(pa);
@@ -1045,19 +2009,6 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
-/*
- * coremap_pinwait: wait for a pinned page to unpin.
- */
-static
-void
-coremap_pinwait(void)
-{
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
-}
-
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
@@ -1167,51 +2118,285 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
  */
 
 /*
- * mmu_setas: Set current address space in MMU.
+ * mmu_initas: Set up the MMU state (the page table) for a new
+ * address space. Second-level tables are added later by mmu_prepare.
+ *
+ * Synchronization: none.
+ */
+int
+mmu_initas(struct addrspace *as)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		pt->pt_l2[i] = NULL;
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		pt->pt_asid[i] = 0;
+	}
+	pt->pt_spare = NULL;
+	as->as_pagetable = pt;
+	return 0;
+}
+
+/*
+ * mmu_cleanupas: Free the page table of an address space that's going
+ * away. Everything in it must have been unmapped already, so there
+ * are no TLB entries left with its ASIDs; and those ASIDs aren't
+ * handed out again until a new generation, so they need no cleanup.
+ *
+ * Synchronization: takes coremap_spinlock to make sure no CPU's
+ * refill code is still pointed at the page table. Does not block.
+ */
+void
+mmu_cleanupas(struct addrspace *as)
+{
+	struct pagetable *pt = as->as_pagetable;
+	unsigned i, j;
+
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i<MAXCPUS; i++) {
+		if (cpupagetables[i] == (vaddr_t)pt) {
+			cpupagetables[i] = 0;
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+
+	for (i=0; i<PT_L1SIZE; i++) {
+		if (pt->pt_l2[i] == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2SIZE; j++) {
+			KASSERT(pt->pt_l2[i][j] == 0);
+		}
+		kfree(pt->pt_l2[i]);
+	}
+	if (pt->pt_spare != NULL) {
+		kfree(pt->pt_spare);
+	}
+	kfree(pt);
+	as->as_pagetable = NULL;
+}
+
+/*
+ * mmu_prepare: Make sure the page table of AS has room for an entry
+ * for VA, and a spare cm_mapping to record it with, so mmu_map won't
+ * need to allocate memory. Called before handling a fault.
+ *
+ * Synchronization: the page table belongs to the caller, but the
+ * clock hand may look at it, so install the new table under
+ * coremap_spinlock. May block in kmalloc.
+ */
+int
+mmu_prepare(struct addrspace *as, vaddr_t va)
+{
+	struct pagetable *pt = as->as_pagetable;
+	uint32_t *l2;
+	unsigned i;
+
+	KASSERT(va < USERSPACETOP);
+
+	if (pt->pt_spare == NULL) {
+		spinlock_acquire(&coremap_spinlock);
+		pt->pt_spare = mapping_freelist;
+		if (pt->pt_spare != NULL) {
+			mapping_freelist = pt->pt_spare->mp_next;
+		}
+		spinlock_release(&coremap_spinlock);
+	}
+	if (pt->pt_spare == NULL) {
+		pt->pt_spare = kmalloc(sizeof(struct cm_mapping));
+		if (pt->pt_spare == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	if (pt->pt_l2[va >> PT_L1SHIFT] != NULL) {
+		return 0;
+	}
+
+	l2 = kmalloc(PT_L2SIZE * sizeof(uint32_t));
+	if (l2 == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<PT_L2SIZE; i++) {
+		l2[i] = 0;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(pt->pt_l2[va >> PT_L1SHIFT] == NULL);
+	pt->pt_l2[va >> PT_L1SHIFT] = l2;
+	spinlock_release(&coremap_spinlock);
+
+	return 0;
+}
+
+/*
+ * mmu_setas: Set current address space in MMU, by loading its ASID on
+ * this CPU (assigning one first if it hasn't got a current one). The
+ * TLB entries of other address spaces can stay. Also points the
+ * refill code at its page table.
  *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_setas(struct addrspace *as)
 {
+	struct pagetable *pt;
+	unsigned me;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as != curcpu->c_vm.cvm_lastas) {
-		curcpu->c_vm.cvm_lastas = as;
-		tlb_clear();
+	me = curcpu->c_number;
+	curcpu->c_vm.cvm_lastas = as;
+	if (as == NULL) {
+		tlb_setasid(0);
+		cpupagetables[me] = 0;
+	}
+	else {
+		pt = as->as_pagetable;
+		if (!asid_current(me, pt->pt_asid[me])) {
+			pt->pt_asid[me] = asid_alloc();
+		}
+		tlb_setasid(pt->pt_asid[me] & ASID_MASK);
+		cpupagetables[me] = (vaddr_t)pt;
 	}
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * mmu_unmap: Remove a translation from the MMU.
+ * mmu_unmap: Remove a translation from the MMU: from the page table
+ * of AS, and from the TLB of any CPU that may have entries for AS.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * The page isn't pinned, so in principle someone could evict it and
+ * reuse it before the shootdown is done; but the address space isn't
+ * running on any other CPU (we're its only thread), so stale entries
+ * there can't be used meanwhile.
+ *
+ * Synchronization: takes coremap_spinlock. May block.
  */
 void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
+	struct cm_mapping *mp, **mpp;
+	uint32_t *pte;
+	unsigned cmix;
+
+	va &= PAGE_FRAME;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as == curcpu->c_vm.cvm_lastas) {
-		tlb_unmap(va);
+	pte = pt_lookup(as->as_pagetable, va);
+	if (pte != NULL && (*pte & TLBLO_PPAGE) == zero_page) {
+		/* untracked; see mmu_map_zero */
+		*pte = 0;
+		tlb_shootdown(as, va);
+		tlb_shootflush();
+	}
+	else if (pte != NULL && *pte != 0) {
+		cmix = PADDR_TO_COREMAP(*pte & TLBLO_PPAGE);
+		KASSERT(cmix < num_coremap_entries);
+		for (mpp = &coremap[cmix].cm_maps; *mpp != NULL;
+		     mpp = &(*mpp)->mp_next) {
+			if ((*mpp)->mp_as == as && (*mpp)->mp_va == va) {
+				break;
+			}
+		}
+		mp = *mpp;
+		KASSERT(mp != NULL);
+		*mpp = mp->mp_next;
+		mp->mp_next = mapping_freelist;
+		mapping_freelist = mp;
+
+		*pte = 0;
+		tlb_shootdown(as, va);
+		tlb_shootflush();
 	}
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * mmu_map: Enter a translation into the MMU. (This is the end result
- * of fault handling.)
+ * mmu_protect_page: Make every translation for physical page PA
+ * read-only, whatever address space and CPU it's in. Used when a page
+ * becomes shared copy-on-write, so no writable mapping survives. The
+ * page must be pinned.
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock. May block.
  */
 void
-mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
+mmu_protect_page(paddr_t pa)
+{
+	unsigned cmix;
+
+	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
+	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+
+	cmix = PADDR_TO_COREMAP(pa);
+
+	spinlock_acquire(&coremap_spinlock);
+	pt_protect_page(cmix);
+	tlb_shootflush();
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_tlbload: load the translation ELO for VA in AS, the current
+ * address space, into this CPU's TLB, reusing the slot of any entry
+ * already there for it.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+mmu_tlbload(struct addrspace *as, vaddr_t va, uint32_t elo)
 {
 	int tlbix;
-	uint32_t ehi, elo;
+	uint32_t ehi, asid;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+
+	asid = as->as_pagetable->pt_asid[curcpu->c_number];
+	KASSERT(asid_current(curcpu->c_number, asid));
+
+	ehi = (va & TLBHI_VPAGE) | ((asid & ASID_MASK) << TLBHI_PIDSHIFT);
+
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix < 0) {
+		tlbix = mipstlb_getslot();
+	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
+	      (unsigned long) (elo & TLBLO_PPAGE), tlbix);
+
+	tlb_write(ehi, elo, tlbix);
+}
+
+/*
+ * mmu_map: Enter a translation into the MMU: into the page table of
+ * AS, so later TLB misses can be refilled without coming here, and
+ * into the TLB. (This is the end result of fault handling.) The page
+ * table must have room (mmu_prepare). The page may be mapped in other
+ * places too; this mapping is added to the ones it has.
+ *
+ * Synchronization: Takes coremap_spinlock. May block, if the zero
+ * page was mapped here and that needs a shootdown.
+ */
+void
+mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
+{
+	struct cm_mapping *mp;
+	uint32_t elo;
+	uint32_t *pte;
 	unsigned cmix;
 	
 	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
 	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+
+	va &= PAGE_FRAME;
 	
 	spinlock_acquire(&coremap_spinlock);
 
@@ -1223,30 +2408,52 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	/* Page must be pinned. */
 	KASSERT(coremap[cmix].cm_pinned);
 
-	tlbix = tlb_probe(va, 0);
-	if (tlbix < 0) {
-		KASSERT(coremap[cmix].cm_tlbix == -1);
-		KASSERT(coremap[cmix].cm_cpunum == 0);
-		tlbix = mipstlb_getslot();
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		coremap[cmix].cm_tlbix = tlbix;
-		coremap[cmix].cm_cpunum = curcpu->c_number;
-		DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
-	}
-	else {
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
+	pte = pt_lookup(as->as_pagetable, va);
+	KASSERT(pte != NULL);
+
+	/*
+	 * If the zero page was mapped here, this is the first write;
+	 * other CPUs may still have it in their TLBs.
+	 */
+	if ((*pte & TLBLO_PPAGE) == zero_page) {
+		*pte = 0;
+		tlb_shootdown(as, va);
+		tlb_shootflush();
+		/* we may have slept (and moved) */
+		KASSERT(as == curcpu->c_vm.cvm_lastas);
 	}
 
-	ehi = va & TLBHI_VPAGE;
+	/* Anything else mapped here should have been unmapped first. */
+	KASSERT(*pte == 0 || (*pte & TLBLO_PPAGE) == pa);
+
 	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 	if (writable) {
 		elo |= TLBLO_DIRTY;
 	}
 
-	tlb_write(ehi, elo, tlbix);
+	/* Record the mapping, unless this is a remap (see pt_unreference). */
+	for (mp = coremap[cmix].cm_maps; mp != NULL; mp = mp->mp_next) {
+		if (mp->mp_as == as && mp->mp_va == va) {
+			break;
+		}
+	}
+	if (mp == NULL) {
+		KASSERT(*pte == 0);
+		mp = as->as_pagetable->pt_spare;
+		KASSERT(mp != NULL);
+		as->as_pagetable->pt_spare = NULL;
+		mp->mp_as = as;
+		mp->mp_va = va;
+		mp->mp_next = coremap[cmix].cm_maps;
+		coremap[cmix].cm_maps = mp;
+	}
+
+	*pte = elo;
+
+	mmu_tlbload(as, va, elo);
+
+	/* Tell the clock hand it's in use. */
+	coremap[cmix].cm_referenced = 1;
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
@@ -1254,3 +2461,31 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	spinlock_release(&coremap_spinlock);
 }
+
+/*
+ * mmu_map_zero: Map the zero page read-only at VA in AS, for a read
+ * of an anonymous page that has never been written. The first write
+ * faults, and mmu_map replaces this with the page's own mapping.
+ * The page table must have room (mmu_prepare).
+ *
+ * Synchronization: Takes coremap_spinlock. Does not block.
+ */
+void
+mmu_map_zero(struct addrspace *as, vaddr_t va)
+{
+	uint32_t *pte;
+
+	va &= PAGE_FRAME;
+
+	spinlock_acquire(&coremap_spinlock);
+
+	pte = pt_lookup(as->as_pagetable, va);
+	KASSERT(pte != NULL);
+	KASSERT(*pte == 0 || (*pte & TLBLO_PPAGE) == zero_page);
+
+	*pte = (zero_page & TLBLO_PPAGE) | TLBLO_VALID;
+	mmu_tlbload(as, va, *pte);
+	ct_zero_maps++;
+
+	spinlock_release(&coremap_spinlock);
+}
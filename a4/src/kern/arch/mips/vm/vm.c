@@ -63,7 +63,7 @@ vm_bootstrap(void)
 #if OPT_RANDPAGE
 	kprintf("vm: Page replacement: random\n");
 #else
-	kprintf("vm: Page replacement: sequential\n");
+	kprintf("vm: Page replacement: clock\n");
 #endif
 
 #if OPT_RANDTLB
@@ -73,8 +73,8 @@ vm_bootstrap(void)
 #endif
 
 	coremap_bootstrap();
-
-	global_paging_lock = lock_create("global_paging_lock");
+	lpage_bootstrap();
+	vnpages_bootstrap();
 }
 
 /*
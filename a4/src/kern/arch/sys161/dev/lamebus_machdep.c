@@ -50,6 +50,13 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/*
+ * While a cpu is idle, its clock only interrupts once every this many
+ * ticks. Anything that gives an idle cpu work sends it an IPI, and
+ * timeouts come from the ltimer, so these are just a backstop.
+ */
+#define IDLE_HARDCLOCKS 25
+
 /*
  * Access to the on-chip timer.
  *
@@ -73,6 +80,24 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the on-chip timer from zero, to go off after COUNT cycles.
+ * ($9 == c0_count.) Needed when changing the interval at some random
+ * point, since the count might already be past the new value.
+ */
+static
+void
+mips_timer_restart(uint32_t count)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* reset count */
+		"mtc0 %0, $11;"		/* and set compare */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +141,20 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Slow down or restore the clock for the current cpu.
+ */
+void
+mainbus_idleclock(bool idle)
+{
+	if (idle) {
+		mips_timer_restart(CPU_FREQUENCY / HZ * IDLE_HARDCLOCKS);
+	}
+	else {
+		mips_timer_restart(CPU_FREQUENCY / HZ);
+	}
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -268,8 +307,16 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_clear_ipi(lamebus, curcpu);
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		/*
+		 * Reset the timer (this clears the interrupt),
+		 * keeping it slow if we are idle.
+		 */
+		if (curcpu->c_isidle) {
+			mips_timer_set(CPU_FREQUENCY / HZ * IDLE_HARDCLOCKS);
+		}
+		else {
+			mips_timer_set(CPU_FREQUENCY / HZ);
+		}
 		/* and call hardclock */
 		hardclock();
 	}
@@ -35,7 +35,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -94,44 +95,214 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Request queue
+//
+// Requests wait on lh_queue until the disk is free. When it is, the
+// next one is picked in C-LOOK order: the pending request with the
+// lowest starting sector at or beyond the head's position, or if
+// there is none, the lowest starting sector overall, so the head
+// sweeps up the disk and then jumps back to the start. The device
+// tells us nothing of its geometry beyond its size (and rpm, which
+// doesn't help without knowing where the platter is), so sector
+// numbers are the ordering key.
+//
+// The sectors of a request are done back to back without letting
+// anything else in. The interrupt handler moves each sector and
+// starts the next, so nothing needs a thread to drive it; br_done is
+// called from the interrupt handler when the request finishes, after
+// the next request has been started and lh_lock released.
+//
+// lh_lock protects lh_queue, lh_active, lh_headpos, and the pool of
+// wait channels; and since only the holder touches the hardware, the
+// device registers too.
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the current sector of the active request.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startsector(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct blkreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->br_sector < req->br_endsector);
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer. The uio is in kernel space, so this
+	 * cannot fail.
+	 */
+	if (req->br_uio->uio_rw == UIO_WRITE) {
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->br_uio);
+		KASSERT(result == 0);
+		statval |= LHD_ISWRITE;
+	}
+
+	lh->lh_headpos = req->br_sector;
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->br_sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, pick the next request in C-LOOK order and
+ * start it.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct blkreq *req, **pp, **ahead, **lowest;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	ahead = lowest = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->br_next) {
+		req = *pp;
+		if (lowest == NULL || req->br_sector < (*lowest)->br_sector) {
+			lowest = pp;
+		}
+		if (req->br_sector >= lh->lh_headpos &&
+		    (ahead == NULL || req->br_sector < (*ahead)->br_sector)) {
+			ahead = pp;
+		}
+	}
+	pp = (ahead != NULL) ? ahead : lowest;
+
+	req = *pp;
+	*pp = req->br_next;
+	req->br_next = NULL;
+
+	lh->lh_active = req;
+	lhd_startsector(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish the sector, and start the next one.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct blkreq *req, *done = NULL;
 	uint32_t val;
-	
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		/* Not done (or not ours) */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Nothing was running; spurious. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	result = lhd_code_to_errno(lh, val);
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (result == 0 && req->br_uio->uio_rw == UIO_READ) {
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->br_uio);
+		KASSERT(result == 0);
+	}
+
+	req->br_sector++;
+	if (result == 0 && req->br_sector < req->br_endsector) {
+		/* Keep going with the same request. */
+		lhd_startsector(lh);
+	}
+	else {
+		req->br_result = result;
+		lh->lh_active = NULL;
+		done = req;
+		lhd_startnext(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->br_done(done);
 	}
 }
 
+/*
+ * Queue a request. Returns without waiting for it; br_done is called
+ * when it finishes. (This is d_submit.)
+ */
+static
+int
+lhd_submit(struct device *d, struct blkreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct uio *uio = req->br_uio;
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+
+	/* The transfer may happen in interrupt context. */
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (sector+len > lh->lh_dev.d_blocks) {
+		return EINVAL;
+	}
+
+	req->br_sector = sector;
+	req->br_endsector = sector + len;
+	req->br_result = 0;
+
+	if (len == 0) {
+		req->br_done(req);
+		return 0;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	req->br_next = lh->lh_queue;
+	lh->lh_queue = req;
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
 /*
  * Function called when we are open()'d.
  */
@@ -193,86 +364,142 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Synchronous I/O, on top of the request queue.
+ *
+ * The request lives on the caller's stack, and its br_data points at
+ * a struct lhd_syncwait, also on the stack. That borrows one of the
+ * disk's wait channels for as long as the request is outstanding, so
+ * the completion routine can wake just this caller. If they're all in
+ * use, wait on lh_wchan for one to come free.
+ */
+struct lhd_syncwait {
+	struct lhd_softc *sw_lh;
+	struct wchan *sw_wchan;		/* borrowed from lh_waitchans */
+	bool sw_done;			/* protected by lh_lock */
+};
+
+static
+void
+lhd_syncdone(struct blkreq *req)
+{
+	struct lhd_syncwait *sw = req->br_data;
+	struct lhd_softc *lh = sw->sw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	sw->sw_done = true;
+	wchan_wakeone(sw->sw_wchan);
+	spinlock_release(&lh->lh_lock);
+}
+
+static
+int
+lhd_syncio(struct lhd_softc *lh, struct uio *uio)
+{
+	struct lhd_syncwait sw;
+	struct blkreq req;
+	int result;
+
+	sw.sw_lh = lh;
+	sw.sw_done = false;
+	req.br_uio = uio;
+	req.br_done = lhd_syncdone;
+	req.br_data = &sw;
+
+	spinlock_acquire(&lh->lh_lock);
+	while (lh->lh_nfreewaitchans == 0) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	sw.sw_wchan = lh->lh_waitchans[--lh->lh_nfreewaitchans];
+	spinlock_release(&lh->lh_lock);
+
+	result = lhd_submit(&lh->lh_dev, &req);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (result == 0 && !sw.sw_done) {
+		wchan_lock(sw.sw_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(sw.sw_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	lh->lh_waitchans[lh->lh_nfreewaitchans++] = sw.sw_wchan;
+	wchan_wakeone(lh->lh_wchan);
+	spinlock_release(&lh->lh_lock);
+
+	if (result) {
+		return result;
+	}
+	return req.br_result;
+}
+
+/* Size of the bounce buffer for transfers to or from user space. */
+#define LHD_BOUNCESIZE  4096
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel-space transfers go straight through the queue. Transfers to
+ * or from user space (raw device access) can't be done from the
+ * interrupt handler, so they are staged through a bounce buffer.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
-
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	size_t len;
+	int result = 0;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_syncio(lh, uio);
 	}
 
-	/* Don't allow I/O past the end of the disk. */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	/* Check alignment up front, before moving anything. */
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	bounce = kmalloc(LHD_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > LHD_BOUNCESIZE) {
+			len = LHD_BOUNCESIZE;
+		}
+		uio_kinit(&iov, &ku, bounce, len, uio->uio_offset,
+			  uio->uio_rw);
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(bounce, len, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
+			result = lhd_syncio(lh, &ku);
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		else {
+			result = lhd_syncio(lh, &ku);
+			if (result) {
+				break;
+			}
+			result = uiomove(bounce, len, uio);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -282,6 +509,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,23 +517,29 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd-io");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	for (i=0; i<LHD_NWAITCHANS; i++) {
+		lh->lh_waitchans[i] = wchan_create("lhd-req");
+		if (lh->lh_waitchans[i] == NULL) {
+			return ENOMEM;
+		}
 	}
+	lh->lh_nfreewaitchans = LHD_NWAITCHANS;
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,15 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Number of synchronous requests that can be waiting at once; each
+ * gets its own wait channel, so a finished request wakes only its
+ * caller. (Requests queued with d_submit don't use one.)
+ */
+#define LHD_NWAITCHANS  16
+
+struct wchan;
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +61,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct blkreq *lh_queue;	/* Requests waiting, unordered */
+	struct blkreq *lh_active;	/* Request in progress, or NULL */
+	uint32_t lh_headpos;		/* Last sector started */
+	struct wchan *lh_waitchans[LHD_NWAITCHANS]; /* Free ones first */
+	unsigned lh_nfreewaitchans;	/* How many are free */
+	struct wchan *lh_wchan;		/* Callers wait here for a free one */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -41,6 +41,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -175,6 +176,13 @@ sfs_sync(struct fs *fs)
 		sfs->sfs_superdirty = false;
 	}
 
+	/* Write back everything sitting dirty in the buffer cache. */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -225,6 +233,9 @@ sfs_unmount(struct fs *fs)
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
 	
+	/* Flush our blocks out of the buffer cache */
+	buf_drop(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
@@ -268,6 +279,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(SFS_BLOCKSIZE == BUF_BLOCKSIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -316,6 +328,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
+		buf_drop(dev);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
@@ -333,6 +346,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		buf_drop(dev);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
@@ -340,6 +354,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
+		buf_drop(dev);
 		bitmap_destroy(sfs->sfs_freemap);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
@@ -41,6 +41,7 @@
 
 struct vnode;
 struct vm_object; /* from vmprivate.h */
+struct pagetable; /* from the MMU code */
 
 DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
 
@@ -50,7 +51,10 @@ DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
  *
  * In the solution set VM, the address space contains an array of
  * vm_objects. Normally there will be one each for text, data/bss,
- * stack, and heap. More can be added if needed.
+ * stack, and heap. More can be added if needed. The array is kept
+ * sorted by base address, so faults can find their vm_object by
+ * binary search; the one found last is remembered, since faults
+ * tend to come in runs in the same region.
  */
 
 struct addrspace {
@@ -64,7 +68,11 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Add additional address space objects here as necessary. */
-        struct vm_object_array *as_objects;
+        struct vm_object_array *as_objects;	/* sorted by vmo_base */
+        struct vm_object *as_lastobj;	/* last one as_fault found */
+        struct vm_object *as_heap;	/* heap, grown by sbrk */
+        vaddr_t as_heapend;		/* current break (end of heap) */
+        struct pagetable *as_pagetable;	/* for fast TLB refill */
 #endif
 };
 
@@ -91,6 +99,10 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_fileregion - set up a region of memory whose contents
+ *                come from a file, read in as the pages are touched.
+ *                (Not available with dumbvm.)
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -100,6 +112,9 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ * Except with dumbvm, as_complete_load also sets up an empty heap
+ * just above the highest segment, which as_sbrk grows and shrinks.
  */
 
 struct addrspace *as_create(void);
@@ -119,6 +134,15 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+#if !OPT_DUMBVM
+int               as_define_fileregion(struct addrspace *as,
+                                       vaddr_t vaddr, size_t memsize,
+                                       struct vnode *v, off_t offset,
+                                       size_t filesize,
+                                       int readable,
+                                       int writeable,
+                                       int executable);
+#endif
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -127,8 +151,17 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 /*
  * as_fault - handle fault in (the current) address space.
  * as_sbrk - adjust the heap, like the sbrk() system call.
+ * as_mmap - map anonymous memory or part of a file, like mmap().
+ * as_munmap - remove mappings made by as_mmap, like munmap().
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+#if !OPT_DUMBVM
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+            int flags, struct vnode *v, off_t offset, size_t filesize,
+            vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Block buffer cache.
+ *
+ * A fixed pool of block-sized buffers sitting in front of the d_io
+ * routine of block devices. Buffers are indexed by (device, block)
+ * through a hash table; unreferenced buffers are kept on an LRU list
+ * and recycled from the cold end when a miss needs a buffer. Writes
+ * are write-back: a dirty buffer goes to disk when it is evicted or
+ * when buf_sync is called on its device.
+ *
+ * Functions:
+ *     buf_bootstrap  - allocate the buffer pool. Called from vfs_bootstrap.
+ *     buf_read       - get a referenced buffer holding the contents of
+ *                      the requested block, reading it if not cached.
+ *     buf_get        - get a referenced buffer for a block without
+ *                      reading it; for callers about to overwrite the
+ *                      entire block. The contents are undefined unless
+ *                      buf_isvalid says otherwise.
+ *     buf_data       - return the data area of a buffer.
+ *     buf_isvalid    - true if the buffer's data is meaningful.
+ *     buf_markdirty  - note that the caller has (completely) filled in
+ *                      or modified the buffer; it becomes valid and
+ *                      will be written back.
+ *     buf_release    - drop a reference obtained from buf_read/buf_get.
+ *     buf_readahead  - hint that a range of blocks is about to be read;
+ *                      loads the missing ones with as few device
+ *                      requests as possible.
+ *     buf_sync       - write back all dirty buffers for a device.
+ *     buf_invalidate - discard one block's buffer without writing it
+ *                      back; it may not be referenced. Used when the
+ *                      file system frees the block.
+ *     buf_drop       - discard all buffers for a device (after buf_sync);
+ *                      none may be referenced. Used at unmount.
+ *
+ * Dirty buffers holding consecutive blocks are written back together
+ * in a single multi-block device request. On devices that can queue
+ * requests (d_submit), buf_readahead queues its reads and returns
+ * without waiting for them, and buf_sync queues all its writes before
+ * waiting for any.
+ *
+ * The cache serializes its own metadata, but not I/O: the cache lock
+ * is dropped while a buffer is read or written, and only threads that
+ * need that particular buffer wait for it. Nor does it serialize the
+ * contents of a buffer: two threads holding a reference to the same
+ * buffer must agree on who modifies it. (For SFS, vfs_biglock does
+ * this.)
+ */
+
+struct buf;		/* Opaque. */
+struct device;
+
+/* Size of a cached block. Must match the device's d_blocksize. */
+#define BUF_BLOCKSIZE   512
+
+/*
+ * Most blocks moved to or from the device in a single request, when
+ * writing back runs of dirty buffers or reading ahead.
+ */
+#define BUF_MAXCLUSTER  16
+
+void buf_bootstrap(void);
+
+int buf_read(struct device *dev, uint32_t block, struct buf **ret);
+int buf_get(struct device *dev, uint32_t block, struct buf **ret);
+void *buf_data(struct buf *b);
+bool buf_isvalid(struct buf *b);
+void buf_markdirty(struct buf *b);
+void buf_release(struct buf *b);
+void buf_readahead(struct device *dev, uint32_t block, unsigned nblocks);
+
+int buf_sync(struct device *dev);
+void buf_invalidate(struct device *dev, uint32_t block);
+void buf_drop(struct device *dev);
+
+
+#endif /* _BUF_H_ */
@@ -38,8 +38,9 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU by the timer device, when the
+ * countdown set with the function handed to timerclock_attach runs
+ * out, to run timeouts (below).
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -60,6 +61,8 @@ void hardclock_bootstrap(void);
 
 void hardclock(void);
 void timerclock(void);
+void timerclock_attach(void *devdata,
+		       void (*countdown)(void *devdata, uint32_t usecs));
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
@@ -70,8 +73,37 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clocksleep_msec() does the same for a number of milliseconds.
  */
 void clocksleep(int seconds);
+void clocksleep_msec(unsigned msecs);
+
+/*
+ * Timeouts: calls to a function at a point in the future.
+ *
+ * timeout_init sets up a timeout to call FUNC(ARG).
+ * timeout_add arranges for the call to happen USECS microseconds from
+ *    now (up to about 71 minutes). The timeout must not already be
+ *    pending.
+ * timeout_cancel stops a pending timeout. It returns true if the
+ *    timeout was still pending, and false if it had already gone
+ *    off; either way, the function is not running when it returns,
+ *    so the timeout can be reused or freed.
+ *
+ * FUNC is called from the timer interrupt, with no locks held, so
+ * it must not sleep.
+ */
+struct timeout {
+	struct timeout *to_next;	/* next pending, by deadline */
+	uint64_t to_when;		/* deadline (usecs, time of day) */
+	void (*to_func)(void *);	/* function to call */
+	void *to_arg;			/* argument for it */
+	bool to_pending;		/* true if on the pending list */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_add(struct timeout *to, uint32_t usecs);
+bool timeout_cancel(struct timeout *to);
 
 
 #endif /* _CLOCK_H_ */
@@ -35,6 +35,11 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct kmalloc_cpu;	/* private to kmalloc.c */
+
+/* Number of scheduling priority levels, each with its own run queue. */
+#define NRUNQUEUES 4
+
 
 /*
  * Per-cpu structure
@@ -61,13 +66,17 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
+	struct kmalloc_cpu *c_kmalloc;	/* kmalloc's magazines (kmalloc.c) */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[NRUNQUEUES]; /* Run queues, by priority */
+	unsigned c_runcount;		/* Total threads on the run queues */
+	unsigned c_policy;		/* Policy the run queues are set up for */
+	uint64_t c_pass;		/* Stride pass of the last thread run */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -152,7 +161,8 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data,
+ * a batch of NUM mappings at once.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,7 +176,8 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown(unsigned targetcpu,
+		      const struct tlbshootdown *mappings, unsigned num);
 
 void interprocessor_interrupt(void);
 
@@ -36,16 +36,43 @@
 
 
 struct uio;  /* in <uio.h> */
+struct vnode;  /* in <vnode.h> */
+
+/*
+ * Asynchronous block I/O request, for devices that provide d_submit.
+ *
+ * The caller fills in br_uio, which must be UIO_SYSSPACE because the
+ * transfer may be carried out in interrupt context, and br_done, and
+ * must keep the request and its buffers around until br_done is
+ * called. br_done is called exactly once, with br_result set, usually
+ * from the device's interrupt handler; it may not sleep. The driver
+ * holds none of its own locks when it calls br_done, so br_done may
+ * submit more requests.
+ */
+struct blkreq {
+	struct uio *br_uio;		/* what to transfer, and where */
+	int br_result;			/* errno, set before br_done */
+	void (*br_done)(struct blkreq *);
+	void *br_data;			/* for br_done's use */
+
+	/* Private to the driver */
+	struct blkreq *br_next;		/* queue link */
+	uint32_t br_sector;		/* next sector to transfer */
+	uint32_t br_endsector;		/* one past the last sector */
+};
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_submit, if not NULL, queues a blkreq and returns without waiting;
+ * if it returns an error, br_done will not be called.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct blkreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -58,6 +85,9 @@ struct device {
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/* Get the device behind a vnode, or NULL if it isn't a device vnode. */
+struct device *dev_vnode_device(struct vnode *v);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
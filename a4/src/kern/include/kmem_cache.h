@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches, for kernel structures of one fixed size that are
+ * allocated and freed often and are expensive to set up.
+ *
+ * Objects in a cache are kept in their constructed state: the
+ * constructor is run when an object is first made, and the destructor
+ * only when it's finally given back to kmalloc. So an object must be
+ * returned to the cache the way it came out as far as whatever the
+ * constructor set up goes (e.g., a spinlock unheld, a cv with nobody
+ * waiting). Everything else is up to the caller to initialize.
+ *
+ * Functions:
+ *     kmem_cache_create  - make a cache of objects of size SIZE. CTOR
+ *                          returns an error code; either CTOR or DTOR
+ *                          may be NULL. NAME should be a string
+ *                          constant. Returns NULL on error.
+ *     kmem_cache_alloc   - get a constructed object. Returns NULL if
+ *                          out of memory (or if CTOR fails).
+ *     kmem_cache_free    - give an object back.
+ *     kmem_cache_destroy - destroy a cache. All its objects must have
+ *                          been given back.
+ */
+
+struct kmem_cache; /* Opaque */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+#endif /* _KMEM_CACHE_H_ */
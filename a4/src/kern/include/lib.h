@@ -144,6 +144,7 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_reclaim(void);
 
 /*
  * C string functions. 
@@ -55,6 +55,12 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Slow the current cpu's clock interrupts down while it idles (IDLE
+ * true), or put them back to HZ a second.
+ */
+void mainbus_idleclock(bool idle);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
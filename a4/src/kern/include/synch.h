@@ -71,12 +71,17 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is held while lk_busy is set. lk_lock only protects
+ * lk_waiters and going to sleep; see synch.c.
  */
 struct lock {
         char *lk_name;
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+	volatile spinlock_data_t lk_busy;	/* set while held */
+	volatile unsigned lk_waiters;		/* threads that may sleep */
 };
 
 struct lock *lock_create(const char *name);
@@ -126,6 +131,9 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_wait_timeout - Like cv_wait, but give up waiting after MSECS
+ *                   milliseconds. Returns ETIMEDOUT if it timed out,
+ *                   or 0 if woken up; the lock is held again either way.
  *
  * For all three operations, the current thread must hold the lock passed 
  * in. Note that under normal circumstances the same lock should be used
@@ -136,6 +144,7 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_wait_timeout(struct cv *cv, struct lock *lock, unsigned msecs);
 
 
 #endif /* _SYNCH_H_ */
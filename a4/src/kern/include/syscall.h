@@ -61,9 +61,12 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 /* ASST1 setup */
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_getpriority(int which, int who, int *retval);
+int sys_setpriority(int which, int who, int prio);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
 
@@ -84,4 +87,10 @@ int sys_fstat(int fd, userptr_t statptr);
 
 /* END A4 SETUP */
 
+/* Address space calls, in vm_syscalls.c (not available with dumbvm) */
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+
 #endif /* _SYSCALL_H_ */
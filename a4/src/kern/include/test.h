@@ -58,6 +58,8 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int cvtimeouttest(int, char **);
+int lockstresstest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -87,6 +87,13 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_runticks;		/* Ticks used at this level */
+	unsigned t_tickets;		/* Share of the cpu under stride sched */
+	uint64_t t_pass;		/* Stride scheduling virtual time */
+	unsigned t_quanta;		/* Total clock ticks spent running */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on (hint) */
+	unsigned t_lastrun;		/* t_lastcpu's c_hardclocks then */
 
 	/*
 	 * Interrupt state fields.
@@ -165,10 +172,31 @@ void thread_exit(int status);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Periodic scheduler housekeeping: switch to a newly chosen policy,
+ * and under SCHED_MLFQ every so often move all threads back to the
+ * highest priority. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Scheduling policies. The choice takes effect on each cpu at its
+ * next call to schedule().
+ */
+#define SCHED_MLFQ	0	/* Multi-level feedback queue (default) */
+#define SCHED_STRIDE	1	/* Proportional share by tickets */
+
+void thread_setpolicy(unsigned policy);
+unsigned thread_getpolicy(void);
+
+/*
+ * Get or set the nice value (PRIO_MIN to PRIO_MAX, from
+ * <kern/resource.h>) of the current thread. Lower values get more
+ * tickets, and so a larger share of the cpu under SCHED_STRIDE.
+ * New threads inherit the nice value of their parent.
+ */
+int thread_getnice(void);
+void thread_setnice(int nice);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -56,9 +56,21 @@ void swap_bootstrap(void);
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
+/* Start the pageout daemon; needs threads, so runs late in boot. */
+void pageout_bootstrap(void);
+
 /* Print VM counters */
 int vm_printstats(int nargs, char **args);
 
+/*
+ * Keep read() and write() coherent with shared mappings of the file:
+ * write back pages changed through the mappings before touching the
+ * file, and reload the mapped pages a write covered afterwards.
+ */
+struct vnode;
+void vnpages_flush(struct vnode *v);
+void vnpages_update(struct vnode *v, off_t pos, size_t len);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -44,6 +44,9 @@
 #include <array.h>
 #include <spinlock.h>
 struct addrspace;
+struct vm_object;
+struct vnode;
+struct vnpages;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -76,16 +79,39 @@ struct addrspace;
  *     LPF_DIRTY    is set if the page has been modified.
  *     LPF_PINNED   is set if the page is in transit to/from disk.
  *
+ * LPF_DIRTY means the page differs from its copy in swap, and pages of
+ * writable objects start out dirty. For shared file mappings we also
+ * need to know whether the page differs from the file, which survives
+ * the page going out to swap and back; that is lp_modified. It is set
+ * only by write faults (including the first write to a page mapped
+ * read-only) and cleared by lpage_sharedsync when the page is written
+ * back.
+ *
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * After fork, parent and child share their lpages copy-on-write;
+ * lp_refcount counts the vm_objects using the page. A shared page is
+ * only ever mapped read-only, and the first write to it gives the
+ * writer its own copy (see lpage_unshare). While a page is shared,
+ * each reference past the first holds one swap reservation, which
+ * is what pays for the copy.
+ *
+ * Pages of shared file mappings belong to the file's vnpages table
+ * rather than to any vm_object; the objects mapping them hold no
+ * reference, so lp_refcount stays 1 (see vnpages.c).
+ *
+ * Pages of a read-only file-backed vm_object (program text) never
+ * get a swap page. They are never dirty, so eviction just drops
+ * them and the next fault reads them from the file again. Such a
+ * page holds no swap reservation, shared or not.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
+	bool lp_modified;		/* written since loaded from file */
 	struct spinlock lp_spinlock;
 };
 
@@ -101,16 +127,27 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up for lpage_create.
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it if last
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
  *    lpage_copy - clone an lpage, including the contents
+ *    lpage_share - add a copy-on-write reference to an lpage
+ *    lpage_isshared - check if an lpage has more than one reference
+ *    lpage_unshare - trade a reference to a shared lpage for a copy
  *    lpage_zerofill - materialize an lpage and zero-fill it
+ *    lpage_fileload - create an lpage and read it from a vm_object's file
+ *    lpage_sharedload - create an lpage for a page of a shared file
+ *    lpage_sharedsync - write a shared file page back if modified
+ *    lpage_sharedreload - read a shared file page again from the file
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
+ *    lpage_evict_cluster - evict several lpages, writing them out together
+ *    lpage_prefetch - read swapped-out lpages into memory without mapping them
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
@@ -118,10 +155,25 @@ void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
 int	              lpage_copy(struct lpage *from, struct lpage **toret);
+void              lpage_share(struct lpage *lp);
+bool              lpage_isshared(struct lpage *lp);
+int               lpage_unshare(struct lpage *lp, struct addrspace *as,
+			                    vaddr_t va, struct lpage **toret);
 int               lpage_zerofill(struct lpage **lpret);
-int               lpage_fault(struct lpage *lp, struct addrspace *,
+int               lpage_fileload(struct vm_object *vmo, vaddr_t va,
+			                     struct lpage **lpret);
+int               lpage_sharedload(struct vnpages *vnp, unsigned index,
+			                       struct lpage **lpret);
+int               lpage_sharedsync(struct lpage *lp, struct vnpages *vnp,
+			                       unsigned index);
+int               lpage_sharedreload(struct lpage *lp, struct vnpages *vnp,
+			                         unsigned index);
+int               lpage_fault(struct lpage *lp, struct vm_object *vmo,
+			                  struct addrspace *,
 			                  int faulttype, vaddr_t va);
 void              lpage_evict(struct lpage *victim);
+void              lpage_evict_cluster(struct lpage **victims, unsigned n);
+void              lpage_prefetch(struct lpage **lps, unsigned n);
 
 ////////////////////////////////////////////////////////////
 //
@@ -138,11 +190,40 @@ DECLARRAY_BYTYPE(lpage_array, struct lpage);
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * vmo_nextfault and vmo_seqfaults track whether the object is being
+ * faulted in sequentially, so swap can be read ahead. They are
+ * protected by vmo_faultlock.
+ *
+ * A file-backed object (an executable's segment) has a vnode. Its
+ * pages are read from the file on first touch: the bytes at
+ * vmo_filevaddr..vmo_filevaddr+vmo_filesize come from the file
+ * starting at vmo_fileoffset, and the rest is zero. If vmo_readonly
+ * is set, write faults are refused and the pages are never given
+ * swap (see struct lpage), so the object reserves none.
+ *
+ * An object made by mmap has vmo_mapped set, so munmap can tell it
+ * from the program's own segments. A MAP_SHARED file mapping has no
+ * vnode of its own; vmo_vnpages points to the file's table of shared
+ * pages instead, and vmo_fileoffset says where in the file the object
+ * starts. Its pages belong to the table, which is shared with every
+ * other mapping of the file (including a forked child's copy), so the
+ * object neither references them nor reserves swap for them.
  */
 struct vm_object {
 	struct lpage_array *vmo_lpages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+	unsigned vmo_nextfault;		/* page index we'd fault on next */
+	unsigned vmo_seqfaults;		/* length of current sequential run */
+	struct spinlock vmo_faultlock;	/* for the above two */
+	struct vnode *vmo_vnode;	/* backing file, or NULL */
+	off_t vmo_fileoffset;		/* file offset of vmo_filevaddr */
+	vaddr_t vmo_filevaddr;		/* where the file contents start */
+	size_t vmo_filesize;		/* how many bytes come from the file */
+	bool vmo_readonly;		/* no writes; no swap */
+	bool vmo_mapped;		/* made by mmap */
+	struct vnpages *vmo_vnpages;	/* shared file pages, or NULL */
 };
 
 /*
@@ -150,12 +231,31 @@ struct vm_object {
  * 
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_create_file: likewise, but backed by part of a file.
+ * vm_object_create_shared: likewise, for a shared mapping of a file.
+ * vm_object_copy:    clone a vm_object, as at fork time. The pages
+ *                    are shared copy-on-write, not copied.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
  * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_fault_around: note a fault, and if the object is being
+ *                    walked sequentially, prefetch the following pages.
+ * vm_object_readpage: read the file contents of a page of a
+ *                    file-backed object into a pinned physical page.
+ * vm_object_writepage: the reverse; write a pinned physical page
+ *                    back to the file contents of a page.
+ * vm_object_hasfiledata: check whether a page of a file-backed object
+ *                    has any contents from the file (or is all bss).
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
+struct vm_object	*vm_object_create_file(size_t npages,
+					       struct vnode *v, off_t offset,
+					       vaddr_t filevaddr,
+					       size_t filesize,
+					       bool readonly);
+struct vm_object	*vm_object_create_shared(size_t npages,
+						 struct vnpages *vnp,
+						 off_t offset, bool readonly);
 int			        vm_object_copy(struct vm_object *vmo,
 					               struct addrspace *newas,
 					               struct vm_object **newvmo_ret);
@@ -164,6 +264,66 @@ int                 vm_object_setsize(struct addrspace *as,
 					                  unsigned newnpages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
+void			vm_object_fault_around(struct vm_object *vmo,
+					       unsigned index);
+int			vm_object_readpage(struct vm_object *vmo, vaddr_t va,
+					   paddr_t pa);
+int			vm_object_writepage(struct vm_object *vmo, vaddr_t va,
+					    paddr_t pa);
+bool			vm_object_hasfiledata(struct vm_object *vmo,
+					      vaddr_t va);
+
+////////////////////////////////////////////////////////////
+//
+// vnpages - pages of a file shared by its MAP_SHARED mappings
+//
+
+/*
+ * There is one vnpages per file with shared mappings. It holds one
+ * lpage per page of the file that has been touched through any of
+ * them, so every mapping sees the same physical page; the pages are
+ * kept until the last mapping goes away, and then written back.
+ * The pages otherwise behave like anonymous memory: they get swap,
+ * and lp_modified says which ones differ from the file.
+ *
+ * vnp_lpages is protected by vnp_lock. vnp_refcount counts the
+ * vm_objects using the table and, with vnp_next, is protected by the
+ * global lock in vnpages.c.
+ */
+struct vnpages {
+	struct vnode *vnp_vnode;
+	struct lpage_array *vnp_lpages;	/* by page of the file */
+	unsigned vnp_refcount;
+	struct lock *vnp_lock;
+	struct vnpages *vnp_next;
+};
+
+/*
+ * vnpages operations in vnpages.c:
+ *
+ * vnpages_bootstrap: set up the table of tables.
+ * vnpages_get:      find or create the table for a vnode, and add a
+ *                   reference to it.
+ * vnpages_incref:   add a reference to a table, for fork.
+ * vnpages_decref:   drop a reference; the last one writes the modified
+ *                   pages back and destroys the table.
+ * vnpages_getpage:  find or load a page of the file.
+ * vnpages_readpage: read a page of the file into a pinned physical page.
+ * vnpages_writepage: write a pinned physical page back to the file.
+ *
+ * vnpages_flush and vnpages_update, for read() and write(), are
+ * declared in vm.h.
+ */
+void		vnpages_bootstrap(void);
+struct vnpages	*vnpages_get(struct vnode *v);
+void		vnpages_incref(struct vnpages *vnp);
+void		vnpages_decref(struct vnpages *vnp);
+int		vnpages_getpage(struct vnpages *vnp, unsigned index,
+				struct lpage **lpret);
+int		vnpages_readpage(struct vnpages *vnp, unsigned index,
+				 paddr_t pa);
+int		vnpages_writepage(struct vnpages *vnp, unsigned index,
+				  paddr_t pa);
 
 ////////////////////////////////////////////////////////////
 //
@@ -181,6 +341,10 @@ void 			 vm_object_destroy(struct addrspace *as,
  * swap_alloc:       finds a free swap page and marks it as used.
  *                   A page should have been previously reserved.
  *
+ * swap_alloc_cluster: finds a run of free swap pages and marks them
+ *                   as used. Does not consume reservations; returns
+ *                   INVALID_SWAPADDR if there is no such run.
+ *
  * swap_free:        unmarks a swap page.
  *
  * swap_reserve:     reserve some swap pages for future allocation.
@@ -192,9 +356,21 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
+ *
+ * swap_pagein_cluster: Reads up to SWAP_MAXCLUSTER pages from
+ *                   consecutive swap addresses in one disk request.
+ *
+ * swap_pageout_cluster: Writes up to SWAP_MAXCLUSTER pages to
+ *                   consecutive swap addresses in one disk request.
+ *
+ * swap_pageout_runs: Writes up to SWAP_MAXCLUSTER pages to sorted but
+ *                   not necessarily consecutive swap addresses, one
+ *                   request per run, all queued at once. Returns the
+ *                   number of requests.
  */
 
 off_t	 	swap_alloc(void);
+off_t		swap_alloc_cluster(unsigned npages);
 void 		swap_free(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
@@ -202,6 +378,12 @@ void		swap_unreserve(unsigned long npages);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *paddrs, unsigned npages,
+				    off_t swapaddr);
+void		swap_pageout_cluster(const paddr_t *paddrs, unsigned npages,
+				     off_t swapaddr);
+unsigned	swap_pageout_runs(const paddr_t *paddrs, const off_t *swapaddrs,
+				  unsigned npages);
 
 /*
  * Special disk address:
@@ -210,11 +392,9 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
 #define INVALID_SWAPADDR	(0)
 
 /*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
+ * Most pages written to swap in one request.
  */
-extern struct lock *global_paging_lock;
+#define SWAP_MAXCLUSTER		8
 
 ////////////////////////////////////////////////////////////
 //
@@ -71,6 +71,12 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but give up after USECS microseconds. Returns 0
+ * if awakened, or ETIMEDOUT if the time ran out first.
+ */
+int wchan_sleep_timeout(struct wchan *wc, uint32_t usecs);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
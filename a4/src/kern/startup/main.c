@@ -133,6 +133,9 @@ boot(void)
 	 * come before additional cpus are brought online.
 	 */
 	pid_bootstrap(); 
+#if !OPT_DUMBVM
+	pageout_bootstrap(); /* Needs pids; start before other cpus come up */
+#endif
 	/*dumb_consoleIO_bootstrap();*/ /* And initialize for user console IO */
 
 	thread_start_cpus();
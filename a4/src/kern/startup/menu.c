@@ -368,6 +368,30 @@ cmd_rmdir(int nargs, char **args)
 }
 /* END A4 SETUP */
 
+/*
+ * Command for viewing or setting the scheduling policy.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Scheduler: %s\n",
+			thread_getpolicy() == SCHED_STRIDE ? "stride" : "mlfq");
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "mlfq")) {
+		thread_setpolicy(SCHED_MLFQ);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "stride")) {
+		thread_setpolicy(SCHED_STRIDE);
+		return 0;
+	}
+	kprintf("Usage: sched [mlfq | stride]\n");
+	return EINVAL;
+}
+
 /*
  * Command for changing directory.
  */
@@ -601,6 +625,7 @@ static const char *opsmenu[] = {
 	"[s]       Shell                     ",
 	"[p]       Other program             ",
 	"[dbflags] View or set debug flags   ",
+	"[sched]   View or set scheduler     ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
@@ -642,6 +667,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] CV timeout test               ",
+	"[sy5] Lock stress test      (1)     ",
 /* BEGIN A3 SETUP */
 /* Only include coremap tests if not using dumbvm */
 #if !OPT_DUMBVM
@@ -721,6 +748,7 @@ static struct {
 	{ "s",		cmd_shell },
 	{ "p",		cmd_prog },
 	{ "dbflags", cmd_dbflags },
+	{ "sched",	cmd_sched },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
@@ -763,6 +791,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	cvtimeouttest },
+	{ "sy5",	lockstresstest },
 
 	/* ASST2 tests */
 	/* For testing the wait implementation. */
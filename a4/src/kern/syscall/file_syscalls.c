@@ -24,6 +24,7 @@
 #include <file.h>
 #include <kern/seek.h> /* For lseek */
 #include <spinlock.h>
+#include <vm.h>
 /*
  * mk_useruio
  * sets up the uio for a USERSPACE transfer. 
@@ -176,6 +177,10 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 
 	/* does the read */
     spinlock_release(&ft->ft_spinlock);
+#if !OPT_DUMBVM
+	/* pick up stores made through shared mappings of the file */
+	vnpages_flush(ft->ft_entries[fd]->ft_vnode);
+#endif
 	result = VOP_READ(ft->ft_entries[fd]->ft_vnode, &user_uio);
 	if (result) {
 		return result;
@@ -245,10 +250,14 @@ sys_write(int fd, userptr_t buf, size_t len, int *retval)
     offset = ft->ft_entries[fd]->ft_pos;
     mk_useruio(&user_iov, &user_uio, buf, len, offset, UIO_WRITE);
 
-    /* does the write */
+    /* does the write; don't hold the spinlock, it may sleep */
+    spinlock_release(&ft->ft_spinlock);
+#if !OPT_DUMBVM
+    /* don't let stores made through shared mappings overwrite it later */
+    vnpages_flush(ft->ft_entries[fd]->ft_vnode);
+#endif
     result = VOP_WRITE(ft->ft_entries[fd]->ft_vnode, &user_uio);
     if (result) {
-        spinlock_release(&ft->ft_spinlock);
         return result;
     }
 
@@ -257,8 +266,13 @@ sys_write(int fd, userptr_t buf, size_t len, int *retval)
      * minus how much is left in it.
      */
     *retval = len - user_uio.uio_resid;
+#if !OPT_DUMBVM
+    /* and let the shared mappings see it */
+    vnpages_update(ft->ft_entries[fd]->ft_vnode, offset, *retval);
+#endif
     
     /* Advance file seek position. */
+    spinlock_acquire(&ft->ft_spinlock);
     ft->ft_entries[fd]->ft_pos += *retval;
 
     spinlock_release(&ft->ft_spinlock);
@@ -5,6 +5,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <thread.h>
 #include <current.h>
@@ -47,6 +49,59 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_getpriority, sys_setpriority
+ *
+ * Get or set the nice value of a process. Only the calling process
+ * can be named, either as 0 or by its own pid; its children inherit
+ * the value. Out-of-range values are clamped, as in BSD.
+ */
+
+static
+int
+priority_checkwho(int which, int who)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who != 0 && who != curthread->t_pid) {
+		return EPERM;
+	}
+	return 0;
+}
+
+int
+sys_getpriority(int which, int who, int *retval)
+{
+	int result;
+
+	result = priority_checkwho(which, who);
+	if (result) {
+		return result;
+	}
+	*retval = thread_getnice();
+	return 0;
+}
+
+int
+sys_setpriority(int which, int who, int prio)
+{
+	int result;
+
+	result = priority_checkwho(which, who);
+	if (result) {
+		return result;
+	}
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	else if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+	thread_setnice(prio);
+	return 0;
+}
+
 /*
  * sys_getpid
  * Placeholder to remind you to implement this.
@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,39 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time in USER_REQ, rounded up to a millisecond.
+ *
+ * There are no signals, so the sleep is never cut short and there is
+ * never anything to report in USER_REM.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req;
+	unsigned msecs;
+	int result;
+
+	(void)user_rem;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	/* Whole seconds one at a time, so the count can't overflow. */
+	while (req.tv_sec > 0) {
+		clocksleep_msec(1000);
+		req.tv_sec--;
+	}
+	msecs = (req.tv_nsec + 999999) / 1000000;
+	if (msecs > 0) {
+		clocksleep_msec(msecs);
+	}
+
+	return 0;
+}
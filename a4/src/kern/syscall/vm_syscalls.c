@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <current.h>
+#include <thread.h>
+#include <vnode.h>
+#include <file.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <syscall.h>
+
+/*
+ * System calls for managing the address space.
+ */
+
+/*
+ * sbrk: move the break (the end of the heap) by AMOUNT bytes, and
+ * return the old break.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	vaddr_t oldbreak;
+	int result;
+
+	result = as_sbrk(curthread->t_addrspace, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LEN bytes of zeros (MAP_ANON), or of the file open on FD
+ * starting at OFFSET, and return where. Bytes past the end of the
+ * file read as zero. ADDR is only used with MAP_FIXED.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct filetable *ft = curthread->t_filetable;
+	struct vnode *v;
+	struct stat st;
+	int openflags;
+	size_t filesize;
+	vaddr_t va;
+	int result;
+
+	if (len == 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if ((flags & MAP_TYPE) != MAP_SHARED &&
+	    (flags & MAP_TYPE) != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	if (flags & MAP_ANON) {
+		result = as_mmap(curthread->t_addrspace, (vaddr_t)addr, len,
+				 prot, flags, NULL, 0, 0, &va);
+		if (result) {
+			return result;
+		}
+		*retval = (int)va;
+		return 0;
+	}
+
+	if (offset < 0) {
+		return EINVAL;
+	}
+
+	/* Hold onto the vnode, in case someone closes the file. */
+	spinlock_acquire(&ft->ft_spinlock);
+	if (fd < 0 || fd >= __OPEN_MAX || ft->ft_entries[fd] == NULL ||
+	    ft->ft_entries[fd]->ft_vnode == NULL) {
+		spinlock_release(&ft->ft_spinlock);
+		return EBADF;
+	}
+	v = ft->ft_entries[fd]->ft_vnode;
+	openflags = ft->ft_entries[fd]->ft_flags & O_ACCMODE;
+	spinlock_release(&ft->ft_spinlock);
+	/* VOP_INCREF may sleep. Our one thread can't close fd meanwhile. */
+	VOP_INCREF(v);
+
+	/* We need to read the file, and to write it back if shared. */
+	if (openflags == O_WRONLY ||
+	    ((flags & MAP_TYPE) == MAP_SHARED && (prot & PROT_WRITE) &&
+	     openflags != O_RDWR)) {
+		result = EACCES;
+	}
+	else {
+		result = VOP_MMAP(v);
+	}
+	if (result == 0) {
+		result = VOP_STAT(v, &st);
+	}
+	if (result) {
+		VOP_DECREF(v);
+		return result;
+	}
+
+	if (st.st_size <= offset) {
+		filesize = 0;
+	}
+	else if (st.st_size - offset < (off_t)len) {
+		filesize = st.st_size - offset;
+	}
+	else {
+		filesize = len;
+	}
+
+	/* The vm_object takes its own reference to the vnode. */
+	result = as_mmap(curthread->t_addrspace, (vaddr_t)addr, len, prot,
+			 flags, v, offset, filesize, &va);
+	VOP_DECREF(v);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)va;
+	return 0;
+}
+
+/*
+ * munmap: remove the mappings in the LEN bytes at ADDR.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	return as_munmap(curthread->t_addrspace, (vaddr_t)addr, len);
+}
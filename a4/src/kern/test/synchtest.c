@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -43,7 +44,11 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NSTRESSLOOPS  2000
 #define NTHREADS      32
+#define CVTIMEOUT_MS  100	/* timeout that should expire */
+#define CVSIGNAL_MS   50	/* delay before signalling instead */
+#define CVLONG_MS     10000	/* timeout that should not expire */
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -304,3 +309,208 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Milliseconds since SECS1/NSECS1.
+ */
+static
+unsigned
+msecs_since(time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2;
+	uint32_t nsecs2;
+
+	gettime(&secs2, &nsecs2);
+	if (nsecs2 < nsecs1) {
+		secs2--;
+		nsecs2 += 1000000000;
+	}
+	return (secs2 - secs1) * 1000 + (nsecs2 - nsecs1) / 1000000;
+}
+
+static
+void
+cvtimeoutthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	clocksleep_msec(CVSIGNAL_MS);
+
+	lock_acquire(testlock);
+	testval1 = 1;
+	cv_signal(testcv, testlock);
+	lock_release(testlock);
+
+	V(donesem);
+}
+
+/*
+ * cv_wait_timeout: first wait with nobody to signal, which must time
+ * out no sooner than asked; then wait with a long timeout while
+ * another thread signals, which must wake us well before it. Either
+ * way we must come back holding the lock.
+ */
+int
+cvtimeouttest(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned elapsed;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting CV timeout test...\n");
+
+	lock_acquire(testlock);
+	gettime(&secs, &nsecs);
+	result = cv_wait_timeout(testcv, testlock, CVTIMEOUT_MS);
+	elapsed = msecs_since(secs, nsecs);
+	if (!lock_do_i_hold(testlock)) {
+		panic("cvtimeouttest: lock not held after timing out\n");
+	}
+	lock_release(testlock);
+	if (result != ETIMEDOUT) {
+		kprintf("Unsignalled wait returned %d, not ETIMEDOUT\n",
+			result);
+		kprintf("Test failed\n");
+		return 1;
+	}
+	if (elapsed < CVTIMEOUT_MS) {
+		kprintf("%u ms timeout expired after %u ms\n",
+			CVTIMEOUT_MS, elapsed);
+		kprintf("Test failed\n");
+		return 1;
+	}
+	kprintf("Timed out after %u ms (asked for %u)\n",
+		elapsed, CVTIMEOUT_MS);
+
+	lock_acquire(testlock);
+	testval1 = 0;
+	result = thread_fork("synchtest", cvtimeoutthread, NULL, 0, NULL);
+	if (result) {
+		panic("cvtimeouttest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	gettime(&secs, &nsecs);
+	while (testval1 == 0 && result == 0) {
+		result = cv_wait_timeout(testcv, testlock, CVLONG_MS);
+	}
+	elapsed = msecs_since(secs, nsecs);
+	if (!lock_do_i_hold(testlock)) {
+		panic("cvtimeouttest: lock not held after signal\n");
+	}
+	lock_release(testlock);
+	P(donesem);
+	if (result != 0) {
+		kprintf("Signalled wait returned %d after %u ms\n",
+			result, elapsed);
+		kprintf("Test failed\n");
+		return 1;
+	}
+	kprintf("Signalled after %u ms (timeout %u)\n",
+		elapsed, CVLONG_MS);
+
+	kprintf("CV timeout test done\n");
+
+	return 0;
+}
+
+static
+void
+lockstressthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	(void)junk;
+
+	for (i=0; i<NSTRESSLOOPS; i++) {
+		lock_acquire(testlock);
+		if (!lock_do_i_hold(testlock)) {
+			panic("lockstress: thread %lu acquired the lock "
+			      "but doesn't hold it\n", num);
+		}
+
+		/* Nobody else may be in here with us. */
+		if (testval2 != 0) {
+			fail(num, "testval2 on entry");
+		}
+		testval2 = num + 1;
+
+		/*
+		 * Mostly hold the lock briefly, so waiters on other
+		 * cpus get it by spinning; now and then get switched
+		 * out while holding it, so they have to sleep.
+		 */
+		if (i % 64 == (int)num % 64) {
+			thread_yield();
+		}
+		else {
+			for (j=0; j<20; j++);
+		}
+
+		if (testval2 != num + 1) {
+			fail(num, "testval2 on exit");
+		}
+		testval2 = 0;
+		testval3++;
+		lock_release(testlock);
+
+		if (lock_do_i_hold(testlock)) {
+			panic("lockstress: thread %lu still holds the lock "
+			      "after releasing it\n", num);
+		}
+	}
+	V(donesem);
+}
+
+/*
+ * Lock contention stress: NTHREADS threads take the lock over and
+ * over with very short critical sections, which exercises both the
+ * spinning fast path and falling back to sleeping. Checks mutual
+ * exclusion, lock_do_i_hold on both sides of the lock, and that no
+ * increment made under the lock is lost.
+ */
+int
+lockstresstest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock stress test...\n");
+
+	testval2 = 0;
+	testval3 = 0;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", lockstressthread, NULL, i,
+				     NULL);
+		if (result) {
+			panic("lockstresstest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	if (lock_do_i_hold(testlock)) {
+		panic("lockstresstest: main thread holds the lock\n");
+	}
+	if (testval3 != (unsigned long)NTHREADS * NSTRESSLOOPS) {
+		kprintf("Counted %lu acquisitions, expected %lu\n",
+			testval3, (unsigned long)NTHREADS * NSTRESSLOOPS);
+		kprintf("Test failed\n");
+		return 1;
+	}
+
+	kprintf("Lock stress test done.\n");
+
+	return 0;
+}
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -38,12 +39,14 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * hardclock() runs the scheduler on every cpu HZ times a second
+ * (less often while the cpu is idle). Everything else that needs to
+ * happen at a particular time is a timeout, run from timerclock()
+ * when the timer device's countdown says the first one is due.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
- * skimp on that because we have a known-good hardware clock.
+ * skimp on that because we have a known-good hardware clock, which
+ * we also use as the timebase for timeouts.
  */
 
 /*
@@ -53,10 +56,30 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+/* Longest countdown we give the timer device (usecs). */
+#define TIMEOUT_MAXCOUNT	1000000
+
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Pending timeouts, on a list sorted by deadline. There are rarely
+ * more than a handful (one per sleeping thread at most), and this
+ * makes finding the next one due trivial.
+ *
+ * timeout_armed is the time the timer device was last set to go off
+ * at, or 0 if it isn't set. timeout_firing is the timeout whose
+ * function timerclock() is calling, if any; timeout_cancel waits for
+ * it to finish.
  */
-static struct wchan *lbolt;
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+static struct timeout *timeout_list;
+static uint64_t timeout_armed;
+static struct timeout *timeout_firing;
+
+/* The timer device, from timerclock_attach. */
+static void *timer_devdata;
+static void (*timer_countdown)(void *devdata, uint32_t usecs);
+
+/* Wait channel for clocksleep; only timeouts wake anything on it. */
+static struct wchan *sleepchan;
 
 /*
  * Setup.
@@ -64,26 +87,167 @@ static struct wchan *lbolt;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	sleepchan = wchan_create("clocksleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
 	}
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Called by the timer device that will call timerclock(). COUNTDOWN
+ * makes it interrupt once, after the given number of microseconds.
+ */
+void
+timerclock_attach(void *devdata,
+		  void (*countdown)(void *devdata, uint32_t usecs))
+{
+	KASSERT(timer_countdown == NULL);
+	timer_devdata = devdata;
+	timer_countdown = countdown;
+}
+
+/*
+ * The current time of day, in microseconds.
+ */
+static
+uint64_t
+clock_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Set the timer device to go off when the first pending timeout is
+ * due, unless it is already set to go off by then. Call with
+ * timeout_lock held.
+ */
+static
+void
+timeout_arm(uint64_t now)
+{
+	uint64_t when, delta;
+
+	KASSERT(spinlock_do_i_hold(&timeout_lock));
+
+	if (timeout_list == NULL || timer_countdown == NULL) {
+		return;
+	}
+	when = timeout_list->to_when;
+	if (timeout_armed != 0 && timeout_armed <= when) {
+		return;
+	}
+
+	delta = when > now ? when - now : 1;
+	if (delta > TIMEOUT_MAXCOUNT) {
+		delta = TIMEOUT_MAXCOUNT;
+	}
+	timeout_armed = now + delta;
+	timer_countdown(timer_devdata, delta);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_when = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+	to->to_pending = false;
+}
+
+void
+timeout_add(struct timeout *to, uint32_t usecs)
+{
+	struct timeout **pp;
+	uint64_t now;
+
+	now = clock_now();
+
+	spinlock_acquire(&timeout_lock);
+	KASSERT(!to->to_pending);
+	to->to_when = now + usecs;
+	for (pp = &timeout_list; *pp != NULL; pp = &(*pp)->to_next) {
+		if ((*pp)->to_when > to->to_when) {
+			break;
+		}
+	}
+	to->to_next = *pp;
+	*pp = to;
+	to->to_pending = true;
+	timeout_arm(now);
+	spinlock_release(&timeout_lock);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct timeout **pp;
+	bool waspending;
+
+	spinlock_acquire(&timeout_lock);
+	while (timeout_firing == to) {
+		/* Running on another cpu; wait for it. */
+		spinlock_release(&timeout_lock);
+		spinlock_acquire(&timeout_lock);
+	}
+	waspending = to->to_pending;
+	if (waspending) {
+		for (pp = &timeout_list; *pp != to; pp = &(*pp)->to_next) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = to->to_next;
+		to->to_next = NULL;
+		to->to_pending = false;
+		/* If it was first, the device may go off early; harmless. */
+	}
+	spinlock_release(&timeout_lock);
+
+	return waspending;
+}
+
+/*
+ * This is called by the timer device when its countdown runs out.
+ * Call the functions for all timeouts that are due, and set the
+ * device for the next one.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	wchan_wakeall(lbolt);
+	struct timeout *to;
+	uint64_t now;
+
+	now = clock_now();
+
+	spinlock_acquire(&timeout_lock);
+	if (timeout_firing != NULL) {
+		/* Another cpu is at it; it will pick up anything new. */
+		spinlock_release(&timeout_lock);
+		return;
+	}
+	timeout_armed = 0;
+	while (timeout_list != NULL && timeout_list->to_when <= now) {
+		to = timeout_list;
+		timeout_list = to->to_next;
+		to->to_next = NULL;
+		to->to_pending = false;
+
+		timeout_firing = to;
+		spinlock_release(&timeout_lock);
+		to->to_func(to->to_arg);
+		spinlock_acquire(&timeout_lock);
+		timeout_firing = NULL;
+	}
+	timeout_arm(now);
+	spinlock_release(&timeout_lock);
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, or less often while the processor is idle.
  */
 void
 hardclock(void)
@@ -109,8 +273,17 @@ void
 clocksleep(int num_secs)
 {
 	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
+		clocksleep_msec(1000);
 		num_secs--;
 	}
 }
+
+/*
+ * Suspend execution for MSECS milliseconds.
+ */
+void
+clocksleep_msec(unsigned msecs)
+{
+	wchan_lock(sleepchan);
+	(void)wchan_sleep_timeout(sleepchan, msecs * 1000);
+}
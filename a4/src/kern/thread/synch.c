@@ -34,6 +34,7 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -146,6 +147,62 @@ V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+// Locks are adaptive. An uncontended acquire is one test-and-set of
+// lk_busy, with no spinlock. If the lock is held by a thread that is
+// running on another cpu, it will probably be let go soon, so spin
+// for a while rather than pay for two context switches. Otherwise, or
+// if spinning doesn't pay off, count ourselves in lk_waiters and
+// sleep; lock_release only takes lk_lock to wake someone up if
+// lk_waiters says someone may be asleep.
+//
+// This relies on loads and stores being seen in program order by all
+// cpus, as they are on System/161.
+
+/* Number of times to try for the lock before going to sleep. */
+#define LOCK_MAXSPIN	1000
+
+/*
+ * Try to take the lock, without spinning or sleeping.
+ */
+static
+bool
+lock_tryget(struct lock *lock)
+{
+	return spinlock_data_get(&lock->lk_busy) == 0 &&
+		spinlock_data_testandset(&lock->lk_busy) == 0;
+}
+
+/*
+ * Spin for the lock as long as its holder is running on another cpu,
+ * up to LOCK_MAXSPIN tries. Returns true if we got it.
+ *
+ * The holder is looked at without locking, and may even have exited
+ * by the time we do; the worst that can come of it is spinning or
+ * sleeping when the other would have been better. lk_holder is
+ * briefly NULL while the lock is held at either end of lock_acquire
+ * and lock_release; keep spinning then.
+ */
+static
+bool
+lock_spin(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned i;
+
+	for (i=0; i<LOCK_MAXSPIN; i++) {
+		if (lock_tryget(lock)) {
+			return true;
+		}
+		holder = lock->lk_holder;
+		if (holder != NULL && (holder->t_state != S_RUN ||
+				       holder->t_cpu == curcpu->c_self)) {
+			/* Not running elsewhere; won't let go soon. */
+			return false;
+		}
+	}
+	return false;
+}
 
 struct lock *
 lock_create(const char *name)
@@ -171,6 +228,8 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	spinlock_data_set(&lock->lk_busy, 0);
+	lock->lk_waiters = 0;
         
         return lock;
 }
@@ -181,6 +240,7 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_waiters == 0);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
         
@@ -194,18 +254,29 @@ lock_acquire(struct lock *lock)
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
-	spinlock_acquire(&lock->lk_lock);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
-		wchan_lock(lock->lk_wchan);
-		spinlock_release(&lock->lk_lock);
-                wchan_sleep(lock->lk_wchan);
-
+	if (!lock_tryget(lock) && !lock_spin(lock)) {
+		/*
+		 * Sleep. We are counted in lk_waiters before trying
+		 * again, so if the holder lets go after that it will
+		 * see us and come wake us up; and it can't do that
+		 * until we are on the wait channel, because it needs
+		 * lk_lock first.
+		 */
 		spinlock_acquire(&lock->lk_lock);
+		lock->lk_waiters++;
+		while (!lock_tryget(lock)) {
+			/* As in the semaphore. */
+			wchan_lock(lock->lk_wchan);
+			spinlock_release(&lock->lk_lock);
+			wchan_sleep(lock->lk_wchan);
+
+			spinlock_acquire(&lock->lk_lock);
+		}
+		lock->lk_waiters--;
+		spinlock_release(&lock->lk_lock);
 	}
 
 	lock->lk_holder = curthread;
-	spinlock_release(&lock->lk_lock);
 }
 
 void
@@ -213,25 +284,24 @@ lock_release(struct lock *lock)
 {
 	DEBUGASSERT(lock != NULL);
 
-	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
 	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan);
-	spinlock_release(&lock->lk_lock);
+	spinlock_data_set(&lock->lk_busy, 0);
+
+	if (lock->lk_waiters > 0) {
+		spinlock_acquire(&lock->lk_lock);
+		wchan_wakeone(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+	}
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-	bool ret;
-
 	DEBUGASSERT(lock != NULL);
 
-	spinlock_acquire(&lock->lk_lock);
-	ret = (lock->lk_holder == curthread);
-	spinlock_release(&lock->lk_lock);
-
-        return ret;
+	/* Only we can set lk_holder to ourselves; no locking needed. */
+	return lock->lk_holder == curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -285,6 +355,18 @@ cv_wait(struct cv *cv, struct lock *lock)
 	lock_acquire(lock);
 }
 
+int
+cv_wait_timeout(struct cv *cv, struct lock *lock, unsigned msecs)
+{
+	int result;
+
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_wchan, msecs * 1000);
+	lock_acquire(lock);
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
@@ -46,6 +48,7 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 #include <kern/sysexits.h>
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST2 */
@@ -68,6 +71,45 @@ extern int progthread_pid;
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduling parameters.
+ *
+ * Each cpu has NRUNQUEUES run queues, one per priority level, and
+ * always runs the first thread from the highest-priority nonempty
+ * one. New threads start at the top (level 0). A thread that is
+ * still running when the clock ticks is charged for the tick, and
+ * once it has used MLFQ_ALLOTMENT ticks at its level it drops to the
+ * next one. A thread that goes to sleep moves back up a level. A
+ * thread that yields when only lower levels have anything waiting
+ * drops to the highest of them, so that spinning on thread_yield
+ * doesn't shut them out. Every MLFQ_BOOST_HARDCLOCKS everything on
+ * the cpu goes back to the top, so threads at the bottom cannot
+ * starve.
+ */
+#define MLFQ_ALLOTMENT(prio)	(2U << (prio))	/* 2, 4, 8, ... ticks */
+#define MLFQ_BOOST_HARDCLOCKS	100		/* once a second */
+
+/*
+ * Under stride scheduling, every thread is kept on run queue 0 in
+ * order of its pass, and the one with the lowest pass runs. Each tick
+ * a thread runs adds STRIDE1 / t_tickets to its pass, so over time
+ * threads run in proportion to their tickets. Tickets come from the
+ * nice value: 5 at PRIO_MAX, 105 at 0, and 205 at PRIO_MIN.
+ */
+#define STRIDE1			(1U << 20)
+#define NICE_TICKETS(nice)	(5 * (PRIO_MAX + 1 - (nice)))
+#define TICKETS_NICE(tickets)	(PRIO_MAX + 1 - (int)(tickets) / 5)
+
+/*
+ * When moving threads between cpus, runqueue_remcold looks at this
+ * many threads from the end of the run queues for the one that has
+ * gone longest without running.
+ */
+#define STEAL_SCAN		8
+
+/* The policy chosen with thread_setpolicy. */
+static volatile unsigned sched_policy = SCHED_MLFQ;
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -153,6 +195,13 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_runticks = 0;
+	thread->t_tickets = NICE_TICKETS(0);
+	thread->t_pass = 0;
+	thread->t_quanta = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_lastrun = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -190,6 +239,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -203,6 +253,7 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_kmalloc = NULL;
 
         /* BEGIN A3 SETUP */
 #if !OPT_DUMBVM
@@ -211,7 +262,12 @@ cpu_create(unsigned hardware_number)
         /* END A3 SETUP */
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<NRUNQUEUES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_policy = SCHED_MLFQ;
+	c->c_pass = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -329,6 +385,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -343,9 +401,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<NRUNQUEUES; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -463,6 +524,242 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The cpu's run queue lock must be held.
+ */
+
+/*
+ * Add a thread to the run queues: under SCHED_MLFQ at the end of the
+ * queue for its priority, and under SCHED_STRIDE in pass order, after
+ * any threads with the same pass.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct threadlist *tl;
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_policy == SCHED_MLFQ) {
+		KASSERT(t->t_priority < NRUNQUEUES);
+		threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+		c->c_runcount++;
+		return;
+	}
+
+	/*
+	 * Threads that have been asleep start no earlier than where
+	 * this cpu is now, so they can't make up for lost time by
+	 * hogging it. (Threads from another cpu have already been
+	 * rebased onto this one; see runqueue_addmoved.)
+	 */
+	if (t->t_pass < c->c_pass) {
+		t->t_pass = c->c_pass;
+	}
+
+	tl = &c->c_runqueue[0];
+	for (tln = tl->tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_pass <= t->t_pass) {
+			break;
+		}
+	}
+	if (tln->tln_prev == NULL) {
+		threadlist_addhead(tl, t);
+	}
+	else {
+		threadlist_insertafter(tl, tln->tln_self, t);
+	}
+	c->c_runcount++;
+}
+
+/*
+ * Take the thread that should run next: the first one at the highest
+ * priority. Returns NULL if there are no runnable threads.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<NRUNQUEUES; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			if (c->c_policy == SCHED_STRIDE) {
+				c->c_pass = t->t_pass;
+			}
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a thread to move to another cpu. Prefer the one that has gone
+ * longest without running on this cpu (or never has), since it has
+ * the least cache state here to lose; look at up to STEAL_SCAN
+ * threads, starting from the end that would run last.
+ *
+ * Ordinarily, the cpu's current thread will not appear on its run
+ * queue. However, it can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ * Moving it then would have two cpus running on its stack, so skip
+ * it.
+ *
+ * A stride pass only means something next to the pass of the cpu it
+ * was earned on, and different cpus' passes drift apart. So the
+ * thread comes back carrying just how far it was ahead of this cpu,
+ * for runqueue_addmoved to put on top of the new cpu's pass. (Under
+ * SCHED_MLFQ there's no pass to keep.)
+ *
+ * Returns NULL if there is nothing to take.
+ */
+static
+struct thread *
+runqueue_remcold(struct cpu *c)
+{
+	struct threadlistnode *tln;
+	struct thread *t, *best;
+	unsigned i, bestlevel, scanned, age, bestage;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	best = NULL;
+	bestlevel = bestage = scanned = 0;
+	for (i=NRUNQUEUES; i-- > 0 && scanned < STEAL_SCAN; ) {
+		for (tln = c->c_runqueue[i].tl_tail.tln_prev;
+		     tln->tln_prev != NULL && scanned < STEAL_SCAN;
+		     tln = tln->tln_prev) {
+			t = tln->tln_self;
+			if (t == c->c_curthread) {
+				continue;
+			}
+			scanned++;
+			if (t->t_lastcpu != c) {
+				age = (unsigned)-1;
+			}
+			else {
+				age = c->c_hardclocks - t->t_lastrun;
+			}
+			if (best == NULL || age > bestage) {
+				best = t;
+				bestlevel = i;
+				bestage = age;
+			}
+		}
+	}
+
+	if (best != NULL) {
+		threadlist_remove(&c->c_runqueue[bestlevel], best);
+		c->c_runcount--;
+		if (c->c_policy == SCHED_STRIDE && best->t_pass > c->c_pass) {
+			best->t_pass -= c->c_pass;
+		}
+		else {
+			best->t_pass = 0;
+		}
+	}
+	return best;
+}
+
+/*
+ * Add a thread taken from another cpu by runqueue_remcold, rebasing
+ * its pass on this cpu's.
+ */
+static
+void
+runqueue_addmoved(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_policy == SCHED_STRIDE) {
+		t->t_pass += c->c_pass;
+	}
+	runqueue_add(c, t);
+}
+
+/*
+ * Check if any waiting thread is entitled to run instead of T: under
+ * SCHED_MLFQ, one at the same priority or higher, and under
+ * SCHED_STRIDE, one whose pass is no greater.
+ */
+static
+bool
+runqueue_haswaiting(struct cpu *c, struct thread *t)
+{
+	struct thread *head;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_policy == SCHED_STRIDE) {
+		head = c->c_runqueue[0].tl_head.tln_next->tln_self;
+		return head != NULL && head->t_pass <= t->t_pass;
+	}
+
+	for (i=0; i<=t->t_priority && i<NRUNQUEUES; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Return the highest priority level with a thread waiting, or
+ * NRUNQUEUES if there is none.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<NRUNQUEUES; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Wake up one idle cpu, if there is one, so it can steal the work
+ * that has just queued up elsewhere. (Idle cpus only get a clock
+ * interrupt now and then; see mainbus_idleclock.) The idle flags are
+ * read without locking; a cpu that has just gone busy will simply
+ * find nothing to steal.
+ */
+static
+void
+thread_kick_idle(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -473,6 +770,7 @@ void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
+	unsigned waiting;
 	bool isidle;
 
 	/* Lock the run queue of the target thread's cpu. */
@@ -487,7 +785,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -495,6 +793,21 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/*
+		 * If this leaves a thread waiting for the cpu, let an
+		 * idle cpu come and take it. A thread that is putting
+		 * itself back (thread_yield) will run again right
+		 * away unless something else is queued too.
+		 */
+		waiting = targetcpu->c_runcount;
+		if (target == targetcpu->c_curthread) {
+			waiting--;
+		}
+		if (waiting > 0) {
+			thread_kick_idle();
+		}
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -562,6 +875,8 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_tickets = curthread->t_tickets;
+	newthread->t_pass = curthread->t_pass;
 
 	/* VFS fields */
 	if (curthread->t_cwd != NULL) {
@@ -599,6 +914,112 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Work stealing.
+ *
+ * Called by an idle cpu, without its run queue lock held. Finds the
+ * busiest other cpu that is actually running something and has work
+ * waiting, takes a thread from it, and puts it on our run queue.
+ * Returns true if it got one.
+ *
+ * The run queue counts are read without locking, as a hint; only one
+ * run queue lock is held at a time.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_runcount > most) {
+			victim = c;
+			most = c->c_runcount;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = NULL;
+	if (!victim->c_isidle) {
+		t = runqueue_remcold(victim);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+	if (t == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	t->t_cpu = curcpu->c_self;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_addmoved(curcpu, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
+
+/*
+ * Adjust the priority of a thread that is giving up the cpu to go
+ * into state NEWSTATE.
+ *
+ * If it is in an interrupt, it is being preempted by the clock, so it
+ * used up a whole tick; charge it. Under SCHED_STRIDE that advances
+ * its pass. Under SCHED_MLFQ, demote it once it has used its
+ * allotment at its current level, and if it is going to sleep, it is
+ * probably waiting for I/O, so move it up a level.
+ */
+static
+void
+thread_adjust_priority(struct thread *t, threadstate_t newstate)
+{
+	bool stride = curcpu->c_policy == SCHED_STRIDE;
+
+	switch (newstate) {
+	    case S_READY:
+		if (!t->t_in_interrupt) {
+			/* Voluntary yield; not charged. */
+			break;
+		}
+		t->t_quanta++;
+		if (stride) {
+			t->t_pass += STRIDE1 / t->t_tickets;
+			break;
+		}
+		t->t_runticks++;
+		if (t->t_runticks < MLFQ_ALLOTMENT(t->t_priority)) {
+			break;
+		}
+		t->t_runticks = 0;
+		if (t->t_priority < NRUNQUEUES - 1) {
+			t->t_priority++;
+		}
+		break;
+	    case S_SLEEP:
+		if (stride) {
+			break;
+		}
+		t->t_runticks = 0;
+		if (t->t_priority > 0) {
+			t->t_priority--;
+		}
+		break;
+	    default:
+		break;
+	}
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -613,6 +1034,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	bool slowclock;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -635,14 +1057,33 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Update the thread's priority. */
+	thread_adjust_priority(cur, newstate);
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
-		splx(spl);
-		return;
+	/* Remember where and when we ran, for thread_steal. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastrun = curcpu->c_hardclocks;
+
+	/*
+	 * Micro-optimization: if nothing at our priority or better
+	 * is waiting, just return. But if this is a voluntary yield
+	 * under SCHED_MLFQ and lower-priority threads are waiting,
+	 * the caller is probably waiting for one of them; drop to
+	 * the level of the best one, giving up the rest of our
+	 * allotment, and take turns with it.
+	 */
+	if (newstate == S_READY && !runqueue_haswaiting(curcpu, cur)) {
+		if (cur->t_in_interrupt || curcpu->c_policy != SCHED_MLFQ ||
+		    curcpu->c_runcount == 0) {
+			spinlock_release(&curcpu->c_runqueue_lock);
+			splx(spl);
+			return;
+		}
+		cur->t_priority = runqueue_toplevel(curcpu);
+		cur->t_runticks = 0;
 	}
 
 	/* Put the thread in the right place. */
@@ -678,7 +1119,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * one from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -694,17 +1136,32 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * While actually idling, slow the clock down; there is
+	 * nothing for hardclock to preempt.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	slowclock = false;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				if (!slowclock) {
+					mainbus_idleclock(true);
+					slowclock = true;
+				}
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	if (slowclock) {
+		mainbus_idleclock(false);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -885,6 +1342,9 @@ thread_exit(int exitcode)
 		as_destroy(as);
 	}
 
+	DEBUG(DB_THREADS, "Thread %s exiting after %u ticks\n",
+	      cur->t_name, cur->t_quanta);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -908,17 +1368,121 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). Priorities and passes
+ * are adjusted as threads give up the cpu (see thread_adjust_priority),
+ * so all that is left to do here is switching this cpu's run queues
+ * over when the policy changes, and under SCHED_MLFQ the periodic
+ * boost: every MLFQ_BOOST_HARDCLOCKS, put every thread on this cpu
+ * back at the highest priority.
+ */
+
+/*
+ * Rebuild this cpu's run queues for a new policy. Everything starts
+ * out equal: at the top priority, or at the current pass.
+ */
+static
+void
+schedule_setpolicy(unsigned policy)
+{
+	struct threadlist all;
+	struct thread *t;
+
+	threadlist_init(&all);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = runqueue_remhead(curcpu)) != NULL) {
+		threadlist_addtail(&all, t);
+	}
+	curcpu->c_policy = policy;
+	while ((t = threadlist_remhead(&all)) != NULL) {
+		t->t_priority = 0;
+		t->t_runticks = 0;
+		t->t_pass = curcpu->c_pass;
+		runqueue_add(curcpu, t);
+	}
+	/* If idle, curthread may be asleep or on a run queue; leave it. */
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_runticks = 0;
+		curthread->t_pass = curcpu->c_pass;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&all);
+}
+
+/*
+ * MLFQ priority boost.
  */
+static
+void
+schedule_boost(void)
+{
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<NRUNQUEUES; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = 0;
+			t->t_runticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	/* If idle, curthread may be asleep or on a run queue; leave it. */
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_runticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	unsigned policy = sched_policy;
+
+	if (curcpu->c_policy != policy) {
+		schedule_setpolicy(policy);
+	}
+	else if (policy == SCHED_MLFQ &&
+		 (curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS) == 0) {
+		schedule_boost();
+	}
+}
+
+/*
+ * Choose the scheduling policy.
+ */
+void
+thread_setpolicy(unsigned policy)
+{
+	KASSERT(policy == SCHED_MLFQ || policy == SCHED_STRIDE);
+	sched_policy = policy;
+}
+
+unsigned
+thread_getpolicy(void)
+{
+	return sched_policy;
+}
+
+/*
+ * Nice values. Only the thread itself changes its tickets, so no
+ * locking is needed.
+ */
+int
+thread_getnice(void)
+{
+	return TICKETS_NICE(curthread->t_tickets);
+}
+
+void
+thread_setnice(int nice)
+{
+	KASSERT(nice >= PRIO_MIN && nice <= PRIO_MAX);
+	curthread->t_tickets = NICE_TICKETS(nice);
 }
 
 /*
@@ -926,7 +1490,8 @@ schedule(void)
  *
  * This is also called periodically from hardclock(). If the current
  * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * threads across to those other other CPUs. (Idle CPUs don't wait for
+ * this; they steal work as soon as they run out. See thread_steal.)
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
@@ -951,12 +1516,11 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		/* Unlocked; this is only a hint. */
+		total_count += c->c_runcount;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runcount;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -968,7 +1532,12 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remcold(curcpu);
+		if (t == NULL) {
+			/* The queue shrank since we counted it. */
+			to_send = i;
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -979,38 +1548,10 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (c->c_runcount < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_addmoved(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1034,7 +1575,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_addmoved(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1114,6 +1655,70 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Timeout handling for wchan_sleep_timeout.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wc;		/* channel slept on */
+	struct thread *wt_thread;	/* thread sleeping */
+	bool wt_expired;		/* true if we woke it */
+};
+
+/*
+ * Timeout function: wake the thread, if it is still on the channel.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct wchan *wc = wt->wt_wc;
+	struct threadlistnode *tln;
+	struct thread *target;
+
+	target = NULL;
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == wt->wt_thread) {
+			target = tln->tln_self;
+			threadlist_remove(&wc->wc_threads, target);
+			wt->wt_expired = true;
+			break;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (target != NULL) {
+		thread_make_runnable(target, false);
+	}
+}
+
+int
+wchan_sleep_timeout(struct wchan *wc, uint32_t usecs)
+{
+	struct wchan_timeout wt;
+	struct timeout to;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_wc = wc;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+	timeout_init(&to, wchan_timeout, &wt);
+
+	/*
+	 * The channel is locked until we are on it, so the timeout
+	 * can't miss us even if it goes off right away.
+	 */
+	timeout_add(&to, usecs);
+	thread_switch(S_SLEEP, wc);
+	timeout_cancel(&to);
+
+	return wt.wt_expired ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1227,9 +1832,11 @@ ipi_broadcast(int code)
 }
 
 void
-ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
+ipi_tlbshootdown(unsigned targetcpu,
+		 const struct tlbshootdown *mappings, unsigned num)
 {
         int n;
+        unsigned i;
         struct cpu *target;
 
         target = cpuarray_get(&allcpus, targetcpu);
@@ -1237,12 +1844,17 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         spinlock_acquire(&target->c_ipi_lock);
 
         n = target->c_numshootdown;
-        if (n == TLBSHOOTDOWN_MAX) {
+        if (n == TLBSHOOTDOWN_ALL) {
+                /* already flushing everything */
+        }
+        else if (n + num > TLBSHOOTDOWN_MAX) {
                 target->c_numshootdown = TLBSHOOTDOWN_ALL;
         }
         else {
-                target->c_shootdown[n] = *mapping;
-                target->c_numshootdown = n+1;
+                for (i=0; i<num; i++) {
+                        target->c_shootdown[n+i] = mappings[i];
+                }
+                target->c_numshootdown = n+num;
         }
 
         target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
@@ -1255,9 +1867,9 @@ void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-#if OPT_DUMBVM
-	int i;
-#endif 
+	struct tlbshootdown shootdown[TLBSHOOTDOWN_MAX];
+	int i, numshootdown = 0;
+
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
 
@@ -1285,25 +1897,37 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
+		/*
+		 * Take the requests, so they can be carried out
+		 * without holding the IPI lock: the VM system sends
+		 * shootdowns while holding its own locks, which it
+		 * also needs to carry them out.
+		 */
+		numshootdown = curcpu->c_numshootdown;
+		for (i=0; i<numshootdown; i++) {
+			shootdown[i] = curcpu->c_shootdown[i];
+		}
+		curcpu->c_numshootdown = 0;
+	}
+
+	curcpu->c_ipi_pending = 0;
+	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		if (numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
 		}
 		else {
                        /* BEGIN A3 SETUP */
                         /* To switch between dumbvm and real vm. */
 #if OPT_DUMBVM
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			for (i=0; i<numshootdown; i++) {
+				vm_tlbshootdown(&shootdown[i]);
 			}
 #else
-                        vm_tlbshootdown(curcpu->c_shootdown,
-                                        curcpu->c_numshootdown);
+                        vm_tlbshootdown(shootdown, numshootdown);
 #endif
                         /* END A3 SETUP */
 		}
-		curcpu->c_numshootdown = 0;
 	}
-
-	curcpu->c_ipi_pending = 0;
-	spinlock_release(&curcpu->c_ipi_lock);
 }
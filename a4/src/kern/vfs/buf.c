@@ -0,0 +1,1210 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block buffer cache. See buf.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <current.h>
+#include <device.h>
+#include <buf.h>
+
+/*
+ * Number of buffers in the pool, and number of hash chains.
+ * The stock machine has only 512K of RAM, so be modest.
+ */
+#define BUF_NBUFS	64
+#define BUF_HASHSIZE	61
+
+/*
+ * Number of requests that can be queued on devices with d_submit at
+ * once (see struct bufio).
+ */
+#define BUF_NIO		8
+
+struct bufio;
+
+/*
+ * One cached block.
+ *
+ * b_dev/b_block is the identity of the block; b_dev is NULL for a
+ * buffer that holds nothing. Every buffer with an identity is on
+ * exactly one hash chain. A buffer is on the LRU list if and only if
+ * b_refcount is zero.
+ *
+ * b_busy is set while the buffer is being read or written, which is
+ * done without buf_lock. A busy buffer keeps its identity and isn't
+ * recycled; anyone who needs it finished (to use a block being read,
+ * or to discard one being written) waits on b_cv, or, if b_io is a
+ * detached request, for the request itself (see buf_wait).
+ */
+struct buf {
+	struct device *b_dev;		/* device, or NULL if unassigned */
+	uint32_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUF_BLOCKSIZE bytes */
+	unsigned b_refcount;		/* outstanding buf_read/buf_get */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data newer than the disk */
+	bool b_busy;			/* I/O in progress */
+	struct bufio *b_io;		/* queued request doing it, if any */
+	struct cv *b_cv;		/* signalled when b_busy clears */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list */
+	struct buf *b_lrunext;
+};
+
+/*
+ * Synchronization: buf_lock covers everything below and all fields
+ * of every struct buf except the contents of b_data. It is not held
+ * across disk I/O (see b_busy), but it is a sleep lock so the buffer
+ * cvs can use it. buf_cv is signalled when a buffer becomes available
+ * for recycling, for the (unlikely) case where none is.
+ */
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+static struct buf *buf_pool;
+static struct buf *buf_hash[BUF_HASHSIZE];
+
+/* LRU list: head is the next victim, tail was released most recently. */
+static struct buf *buf_lruhead;
+static struct buf *buf_lrutail;
+
+/* Statistics. */
+static unsigned buf_hits, buf_misses, buf_writebacks, buf_readaheads;
+
+/*
+ * A request for a run of buffers, queued with the device's d_submit.
+ *
+ * buf_sync queues all its writes and then waits for them itself; the
+ * request's owner is the syncing thread. Readahead queues its reads
+ * and returns without waiting; those requests are detached (no
+ * owner), and once they finish the next thread through the cache
+ * finishes them off in buf_reap, since the completion routine runs
+ * in interrupt context and can't take buf_lock.
+ *
+ * bi_inuse and the rest belong to buf_lock; bi_done is set by the
+ * completion routine, so it's under buf_iolock instead, and
+ * buf_iochan is woken whenever any request finishes.
+ */
+struct bufio {
+	struct blkreq bi_req;
+	struct uio bi_uio;
+	struct iovec bi_iov[BUF_MAXCLUSTER];
+	struct buf *bi_bufs[BUF_MAXCLUSTER];
+	unsigned bi_n;			/* how many buffers */
+	bool bi_inuse;			/* slot taken */
+	struct thread *bi_owner;	/* waiting for it, or NULL */
+	bool bi_done;			/* device is finished with it */
+};
+
+static struct bufio buf_io[BUF_NIO];
+static struct spinlock buf_iolock;
+static struct wchan *buf_iochan;
+
+////////////////////////////////////////////////////////////
+//
+// List maintenance
+
+static
+unsigned
+buf_hashfunc(struct device *dev, uint32_t block)
+{
+	return ((uintptr_t)dev / sizeof(struct device) + block)
+		% BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (b = buf_hash[buf_hashfunc(dev, block)]; b; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hash_insert(struct buf *b)
+{
+	unsigned ix = buf_hashfunc(b->b_dev, b->b_block);
+
+	b->b_hashnext = buf_hash[ix];
+	buf_hash[ix] = b;
+}
+
+static
+void
+buf_hash_remove(struct buf *b)
+{
+	struct buf **pp;
+
+	pp = &buf_hash[buf_hashfunc(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the tail (most recently used end) of the LRU list. */
+static
+void
+buf_lru_append(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B at the head of the LRU list, so it is reused first. */
+static
+void
+buf_lru_prepend(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/*
+ * Forget the identity of an unreferenced buffer and make it the next
+ * one to be recycled.
+ */
+static
+void
+buf_discard(struct buf *b)
+{
+	KASSERT(b->b_refcount == 0);
+	KASSERT(!b->b_busy);
+
+	if (b->b_dev != NULL) {
+		buf_hash_remove(b);
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	buf_lru_remove(b);
+	buf_lru_prepend(b);
+}
+
+/*
+ * Find a buffer to recycle: the least recently used one that isn't
+ * busy. Returns NULL if there is none.
+ */
+static
+struct buf *
+buf_victim(void)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		KASSERT(b->b_refcount == 0);
+		if (!b->b_busy) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Mark B's I/O finished and wake whoever was waiting for it. If it
+ * was sitting on the LRU list meanwhile, it can be recycled again.
+ */
+static
+void
+buf_unbusy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+
+	b->b_busy = false;
+	b->b_io = NULL;
+	cv_broadcast(b->b_cv, buf_lock);
+	if (b->b_refcount == 0) {
+		cv_signal(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Set up KU (with IOV) for a transfer of N busy buffers holding
+ * consecutive blocks of one device, scattering into or gathering from
+ * their separate data areas.
+ */
+static
+void
+buf_setupio(struct buf **bufs, unsigned n, enum uio_rw rw,
+	    struct iovec *iov, struct uio *ku)
+{
+	struct device *dev;
+	uint32_t block;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= BUF_MAXCLUSTER);
+
+	dev = bufs[0]->b_dev;
+	block = bufs[0]->b_block;
+	KASSERT(dev != NULL);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == dev);
+		KASSERT(bufs[i]->b_block == block + i);
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = BUF_BLOCKSIZE;
+	}
+	ku->uio_iov = iov;
+	ku->uio_iovcnt = n;
+	ku->uio_offset = ((off_t)block) * BUF_BLOCKSIZE;
+	ku->uio_resid = n * BUF_BLOCKSIZE;
+	ku->uio_segflg = UIO_SYSSPACE;
+	ku->uio_rw = rw;
+	ku->uio_space = NULL;
+}
+
+/*
+ * Transfer N buffers holding consecutive blocks of one device in a
+ * single device request, and wait for it. Retries on EIO; EINVAL
+ * means we asked for something impossible (out of range or
+ * misaligned), which is a kernel bug.
+ *
+ * The uio is rebuilt for each attempt, because a failed transfer may
+ * have consumed part of it.
+ *
+ * The buffers must be busy, and buf_lock must not be held.
+ */
+static
+int
+buf_clusterio(struct buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUF_MAXCLUSTER];
+	struct uio ku;
+	struct device *dev;
+	uint32_t block;
+	int result;
+	int tries=0;
+
+	KASSERT(!lock_do_i_hold(buf_lock));
+
+	dev = bufs[0]->b_dev;
+	block = bufs[0]->b_block;
+
+	DEBUG(DB_VFS, "buf: %s %u-%u\n", rw == UIO_READ ? "read" : "write",
+	      block, block + n - 1);
+
+ retry:
+	buf_setupio(bufs, n, rw, iov, &ku);
+	result = dev->d_io(dev, &ku);
+	if (result == EINVAL) {
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n", block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Completion routine for queued requests. Called in interrupt
+ * context, so all it can do is flag the request and wake the waiters.
+ */
+static
+void
+bufio_done(struct blkreq *req)
+{
+	struct bufio *bi = req->br_data;
+
+	spinlock_acquire(&buf_iolock);
+	bi->bi_done = true;
+	wchan_wakeall(buf_iochan);
+	spinlock_release(&buf_iolock);
+}
+
+/*
+ * Take a free request slot. Returns NULL if they're all in use.
+ */
+static
+struct bufio *
+bufio_get(void)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (i=0; i<BUF_NIO; i++) {
+		if (!buf_io[i].bi_inuse) {
+			buf_io[i].bi_inuse = true;
+			return &buf_io[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Queue the transfer of N busy buffers holding consecutive blocks of
+ * one device, using the slot BI. OWNER is the thread that will wait
+ * for it with bufio_finish, or NULL to leave it to buf_reap. The
+ * device doesn't sleep to queue a request, so buf_lock stays held.
+ */
+static
+void
+bufio_start(struct bufio *bi, struct buf **bufs, unsigned n,
+	    enum uio_rw rw, struct thread *owner)
+{
+	struct device *dev = bufs[0]->b_dev;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(bi->bi_inuse);
+	KASSERT(dev->d_submit != NULL);
+
+	DEBUG(DB_VFS, "buf: queue %s %u-%u\n",
+	      rw == UIO_READ ? "read" : "write",
+	      bufs[0]->b_block, bufs[0]->b_block + n - 1);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_io == NULL);
+		bufs[i]->b_io = bi;
+		bi->bi_bufs[i] = bufs[i];
+	}
+	bi->bi_n = n;
+	bi->bi_owner = owner;
+	bi->bi_done = false;
+
+	buf_setupio(bufs, n, rw, bi->bi_iov, &bi->bi_uio);
+	bi->bi_req.br_uio = &bi->bi_uio;
+	bi->bi_req.br_done = bufio_done;
+	bi->bi_req.br_data = bi;
+
+	result = dev->d_submit(dev, &bi->bi_req);
+	if (result) {
+		panic("buf: d_submit: %s\n", strerror(result));
+	}
+}
+
+/*
+ * Wait for the device to finish with BI, and return its result.
+ * Doesn't finish off the buffers.
+ */
+static
+int
+bufio_wait(struct bufio *bi)
+{
+	KASSERT(!lock_do_i_hold(buf_lock));
+
+	spinlock_acquire(&buf_iolock);
+	while (!bi->bi_done) {
+		wchan_lock(buf_iochan);
+		spinlock_release(&buf_iolock);
+		wchan_sleep(buf_iochan);
+		spinlock_acquire(&buf_iolock);
+	}
+	spinlock_release(&buf_iolock);
+
+	return bi->bi_req.br_result;
+}
+
+/*
+ * Wait for a write we queued, retrying it synchronously (which
+ * retries some more) if it failed, and finish its buffers as
+ * buf_writeback does. Drops buf_lock meanwhile.
+ */
+static
+int
+bufio_finish(struct bufio *bi)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(bi->bi_owner == curthread);
+
+	lock_release(buf_lock);
+	result = bufio_wait(bi);
+	if (result == EIO) {
+		result = buf_clusterio(bi->bi_bufs, bi->bi_n, UIO_WRITE);
+	}
+	lock_acquire(buf_lock);
+
+	for (i=0; i<bi->bi_n; i++) {
+		if (result) {
+			bi->bi_bufs[i]->b_dirty = true;
+		}
+		buf_unbusy(bi->bi_bufs[i]);
+	}
+	if (result == 0) {
+		buf_writebacks += bi->bi_n;
+	}
+	bi->bi_inuse = false;
+	return result;
+}
+
+/*
+ * Finish off every detached request (readahead) that the device is
+ * done with: the buffers become valid, or are thrown away if the read
+ * failed (it was only a hint), and anyone waiting for them is woken.
+ */
+static
+void
+buf_reap(void)
+{
+	struct bufio *bi;
+	struct buf *b;
+	unsigned i, j;
+	bool done;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (i=0; i<BUF_NIO; i++) {
+		bi = &buf_io[i];
+		if (!bi->bi_inuse || bi->bi_owner != NULL) {
+			continue;
+		}
+		spinlock_acquire(&buf_iolock);
+		done = bi->bi_done;
+		spinlock_release(&buf_iolock);
+		if (!done) {
+			continue;
+		}
+
+		result = bi->bi_req.br_result;
+		for (j=0; j<bi->bi_n; j++) {
+			b = bi->bi_bufs[j];
+			KASSERT(b->b_io == bi);
+			if (result == 0) {
+				b->b_valid = true;
+			}
+			buf_unbusy(b);
+			if (result) {
+				buf_discard(b);
+			}
+		}
+		bi->bi_inuse = false;
+	}
+}
+
+/*
+ * Wait for busy buffer B to be finished with. If a detached request
+ * is doing its I/O, nobody else is going to finish it off, so wait for
+ * the device and reap it here. Drops buf_lock meanwhile either way,
+ * so the caller must look again at whatever it was doing.
+ */
+static
+void
+buf_wait(struct buf *b)
+{
+	struct bufio *bi = b->b_io;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+
+	if (bi == NULL || bi->bi_owner != NULL) {
+		KASSERT(bi == NULL || bi->bi_owner != curthread);
+		cv_wait(b->b_cv, buf_lock);
+		return;
+	}
+
+	/*
+	 * If the slot gets reaped and reused before we look, we wait
+	 * for the wrong request; that's harmless.
+	 */
+	lock_release(buf_lock);
+	(void)bufio_wait(bi);
+	lock_acquire(buf_lock);
+	buf_reap();
+}
+
+/*
+ * Read B, which must be referenced, not busy, and not valid, from
+ * disk. Drops buf_lock during the read. On error B is left invalid.
+ */
+static
+int
+buf_fill(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_refcount > 0);
+	KASSERT(!b->b_busy);
+	KASSERT(!b->b_valid);
+
+	b->b_busy = true;
+	lock_release(buf_lock);
+
+	result = buf_clusterio(&b, 1, UIO_READ);
+
+	lock_acquire(buf_lock);
+	if (result == 0) {
+		b->b_valid = true;
+	}
+	buf_unbusy(b);
+	return result;
+}
+
+/*
+ * Collect a dirty buffer, together with any dirty buffers holding the
+ * blocks immediately before and after it, into RUN, in block order,
+ * and mark them busy for writing back. Returns how many.
+ *
+ * The buffers are marked clean before the write rather than after,
+ * so that if one is changed again while it's on its way to the disk,
+ * buf_markdirty sets b_dirty again and the change isn't lost.
+ */
+static
+unsigned
+buf_claimrun(struct buf *b, struct buf **run)
+{
+	struct buf *nb;
+	uint32_t first;
+	unsigned n, i;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_valid);
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_busy);
+
+	/* Extend backwards, leaving room for at least B itself... */
+	first = b->b_block;
+	while (first > 0 && b->b_block - first < BUF_MAXCLUSTER / 2) {
+		nb = buf_lookup(b->b_dev, first - 1);
+		if (nb == NULL || !nb->b_dirty || nb->b_busy) {
+			break;
+		}
+		first--;
+	}
+
+	/* ...then forwards from the start of the run. */
+	n = 0;
+	while (n < BUF_MAXCLUSTER) {
+		nb = buf_lookup(b->b_dev, first + n);
+		if (nb == NULL || !nb->b_dirty || nb->b_busy) {
+			break;
+		}
+		run[n++] = nb;
+	}
+	KASSERT(n > b->b_block - first);
+
+	for (i=0; i<n; i++) {
+		run[i]->b_busy = true;
+		run[i]->b_dirty = false;
+	}
+	return n;
+}
+
+/*
+ * Write back a dirty buffer and its dirty neighbours (see
+ * buf_claimrun) as one request. Drops buf_lock during the write.
+ */
+static
+int
+buf_writeback(struct buf *b)
+{
+	struct buf *run[BUF_MAXCLUSTER];
+	unsigned n, i;
+	int result;
+
+	n = buf_claimrun(b, run);
+	lock_release(buf_lock);
+
+	result = buf_clusterio(run, n, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	for (i=0; i<n; i++) {
+		if (result) {
+			run[i]->b_dirty = true;
+		}
+		buf_unbusy(run[i]);
+	}
+	if (result == 0) {
+		buf_writebacks += n;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+buf_bootstrap(void)
+{
+	unsigned i;
+
+	buf_lock = lock_create("buf_lock");
+	if (buf_lock == NULL) {
+		panic("buf: Could not create buf_lock\n");
+	}
+	buf_cv = cv_create("buf_cv");
+	if (buf_cv == NULL) {
+		panic("buf: Could not create buf_cv\n");
+	}
+	spinlock_init(&buf_iolock);
+	buf_iochan = wchan_create("buf_io");
+	if (buf_iochan == NULL) {
+		panic("buf: Could not create buf_iochan\n");
+	}
+	for (i=0; i<BUF_NIO; i++) {
+		buf_io[i].bi_inuse = false;
+	}
+
+	buf_pool = kmalloc(BUF_NBUFS * sizeof(struct buf));
+	if (buf_pool == NULL) {
+		panic("buf: Could not allocate buffer headers\n");
+	}
+
+	buf_lruhead = buf_lrutail = NULL;
+	for (i=0; i<BUF_NBUFS; i++) {
+		struct buf *b = &buf_pool[i];
+
+		b->b_data = kmalloc(BUF_BLOCKSIZE);
+		if (b->b_data == NULL) {
+			panic("buf: Could not allocate buffer %u\n", i);
+		}
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_refcount = 0;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		b->b_io = NULL;
+		b->b_cv = cv_create("buf");
+		if (b->b_cv == NULL) {
+			panic("buf: Could not create cv for buffer %u\n", i);
+		}
+		b->b_hashnext = NULL;
+		buf_lru_append(b);
+	}
+	for (i=0; i<BUF_HASHSIZE; i++) {
+		buf_hash[i] = NULL;
+	}
+	buf_hits = buf_misses = buf_writebacks = buf_readaheads = 0;
+}
+
+/*
+ * Common code for buf_read and buf_get.
+ *
+ * If the block is being read in by someone else, wait for that rather
+ * than reading it again; other waits are for buffers, not blocks.
+ * Since buf_lock is dropped whenever we wait or do I/O, start over
+ * from the lookup after each.
+ */
+static
+int
+buf_getblock(struct device *dev, uint32_t block, bool doread,
+	     struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+	buf_reap();
+
+ again:
+	b = buf_lookup(dev, block);
+	if (b != NULL && b->b_busy && !b->b_valid) {
+		/* Being read; it may yet fail, so look again after. */
+		buf_wait(b);
+		goto again;
+	}
+	if (b != NULL) {
+		buf_hits++;
+		if (b->b_refcount == 0) {
+			buf_lru_remove(b);
+		}
+		b->b_refcount++;
+		if (doread && !b->b_valid) {
+			/* Someone did buf_get and never filled it. */
+			result = buf_fill(b);
+			if (result) {
+				b->b_refcount--;
+				if (b->b_refcount == 0) {
+					buf_lru_append(b);
+					buf_discard(b);
+				}
+				lock_release(buf_lock);
+				return result;
+			}
+		}
+		lock_release(buf_lock);
+		*ret = b;
+		return 0;
+	}
+
+	/* Take the least recently used buffer that's free. */
+	b = buf_victim();
+	if (b == NULL) {
+		/*
+		 * Every buffer is referenced or busy. Wait for one to
+		 * come back; someone may load our block meanwhile. If
+		 * there are unreferenced busy ones, wait for the oldest
+		 * of those directly, in case it's a detached read that
+		 * needs reaping.
+		 */
+		if (buf_lruhead != NULL) {
+			buf_wait(buf_lruhead);
+		}
+		else {
+			cv_wait(buf_cv, buf_lock);
+		}
+		goto again;
+	}
+	if (b->b_dirty) {
+		result = buf_writeback(b);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		goto again;
+	}
+
+	buf_misses++;
+
+	buf_lru_remove(b);
+	if (b->b_dev != NULL) {
+		buf_hash_remove(b);
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_refcount = 1;
+	buf_hash_insert(b);
+
+	if (doread) {
+		result = buf_fill(b);
+		if (result) {
+			b->b_refcount = 0;
+			buf_lru_append(b);
+			buf_discard(b);
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+
+	lock_release(buf_lock);
+	*ret = b;
+	return 0;
+}
+
+int
+buf_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	return buf_getblock(dev, block, true, ret);
+}
+
+int
+buf_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	return buf_getblock(dev, block, false, ret);
+}
+
+void *
+buf_data(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+bool
+buf_isvalid(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_valid;
+}
+
+void
+buf_markdirty(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_valid = true;
+	b->b_dirty = true;
+	lock_release(buf_lock);
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		buf_lru_append(b);
+		if (!b->b_valid) {
+			/* Got with buf_get but never filled in. */
+			buf_discard(b);
+		}
+		cv_signal(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Get blocks BLOCK through BLOCK+NBLOCKS-1 of DEV into the cache,
+ * reading each run of uncached blocks with one device request. This
+ * is only a hint: it gives up quietly if buffers run short or on I/O
+ * error, leaving the real read to report any problem.
+ *
+ * The buffers claimed for a run are busy until the read finishes, so
+ * anyone else who wants those blocks waits for it instead of reading
+ * them too.
+ *
+ * If the device has d_submit, the reads are queued as detached
+ * requests and we return without waiting for them; buf_reap finishes
+ * them later. Otherwise each read is done on the spot.
+ */
+void
+buf_readahead(struct device *dev, uint32_t block, unsigned nblocks)
+{
+	struct buf *run[BUF_MAXCLUSTER];
+	struct bufio *bi;
+	struct buf *b;
+	unsigned i, n, j;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	if (nblocks > BUF_MAXCLUSTER) {
+		nblocks = BUF_MAXCLUSTER;
+	}
+
+	lock_acquire(buf_lock);
+	buf_reap();
+
+	i = 0;
+	while (i < nblocks) {
+		/* Skip what we already have. */
+		if (buf_lookup(dev, block + i) != NULL) {
+			i++;
+			continue;
+		}
+
+		/*
+		 * If every request slot is in use, the device has
+		 * plenty queued already; don't pile on.
+		 */
+		bi = NULL;
+		if (dev->d_submit != NULL) {
+			bi = bufio_get();
+			if (bi == NULL) {
+				break;
+			}
+		}
+
+		/*
+		 * Claim buffers for the run of missing blocks. Writing
+		 * back a dirty one drops the lock, so check again each
+		 * time that the next block still isn't cached.
+		 */
+		n = 0;
+		while (i + n < nblocks &&
+		       buf_lookup(dev, block + i + n) == NULL) {
+			b = buf_victim();
+			if (b == NULL) {
+				break;
+			}
+			if (b->b_dirty) {
+				if (buf_writeback(b) != 0) {
+					break;
+				}
+				continue;
+			}
+			buf_lru_remove(b);
+			if (b->b_dev != NULL) {
+				buf_hash_remove(b);
+			}
+			b->b_dev = dev;
+			b->b_block = block + i + n;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_refcount = 1;
+			b->b_busy = true;
+			buf_hash_insert(b);
+			run[n++] = b;
+		}
+		if (n == 0) {
+			if (bi != NULL) {
+				bi->bi_inuse = false;
+			}
+			break;
+		}
+
+		buf_readaheads += n;
+		if (bi != NULL) {
+			/* Nobody holds these; they wait on the LRU list. */
+			for (j=0; j<n; j++) {
+				run[j]->b_refcount = 0;
+				buf_lru_append(run[j]);
+			}
+			bufio_start(bi, run, n, UIO_READ, NULL);
+			i += n;
+			continue;
+		}
+
+		lock_release(buf_lock);
+		result = buf_clusterio(run, n, UIO_READ);
+		lock_acquire(buf_lock);
+
+		for (j=0; j<n; j++) {
+			b = run[j];
+			if (result == 0) {
+				b->b_valid = true;
+			}
+			b->b_refcount = 0;
+			buf_lru_append(b);
+			buf_unbusy(b);
+			if (result) {
+				buf_discard(b);
+			}
+		}
+		if (result) {
+			break;
+		}
+		i += n;
+	}
+
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back every dirty buffer belonging to DEV. The dirty buffers
+ * are collected in one pass over the pool and written in block order,
+ * and runs of consecutive dirty blocks go out as single requests. If
+ * the device has d_submit, the requests are all queued before waiting
+ * for any of them (as many as there are free slots; the rest are
+ * written one at a time), so the disk can sweep across them without
+ * stopping.
+ *
+ * Buffers that are busy are waited for: one being written may have
+ * been changed again since, and the caller wants everything that was
+ * dirty when it called to be on disk when it returns.
+ */
+int
+buf_sync(struct device *dev)
+{
+	struct buf *list[BUF_NBUFS];
+	struct buf *run[BUF_MAXCLUSTER];
+	struct bufio *ios[BUF_NIO];
+	struct bufio *bi;
+	struct buf *b;
+	unsigned i, j, n, nio;
+	int result, err;
+
+	lock_acquire(buf_lock);
+	buf_reap();
+
+	n = 0;
+	for (i=0; i<BUF_NBUFS; i++) {
+		b = &buf_pool[i];
+		if (b->b_dev != dev || (!b->b_dirty && !b->b_busy)) {
+			continue;
+		}
+		/* Insertion sort by block number. */
+		for (j = n; j > 0 && list[j-1]->b_block > b->b_block; j--) {
+			list[j] = list[j-1];
+		}
+		list[j] = b;
+		n++;
+	}
+
+	result = 0;
+	nio = 0;
+	for (i=0; i<n && result == 0; i++) {
+		b = list[i];
+		/*
+		 * If it's in one of our own writes, it's taken care
+		 * of. Otherwise wait, but finish our own writes first:
+		 * whoever we're waiting for may be another buf_sync
+		 * waiting for one of ours.
+		 */
+		while (b->b_busy &&
+		       (b->b_io == NULL || b->b_io->bi_owner != curthread)) {
+			for (j=0; j<nio; j++) {
+				err = bufio_finish(ios[j]);
+				if (err && result == 0) {
+					result = err;
+				}
+			}
+			nio = 0;
+			buf_wait(b);
+		}
+		if (result) {
+			break;
+		}
+		/* It may have been written, or even recycled, meanwhile. */
+		if (b->b_busy || b->b_dev != dev || !b->b_dirty) {
+			continue;
+		}
+
+		bi = (dev->d_submit != NULL) ? bufio_get() : NULL;
+		if (bi == NULL) {
+			result = buf_writeback(b);
+			continue;
+		}
+		j = buf_claimrun(b, run);
+		bufio_start(bi, run, j, UIO_WRITE, curthread);
+		ios[nio++] = bi;
+	}
+
+	for (i=0; i<nio; i++) {
+		err = bufio_finish(ios[i]);
+		if (err && result == 0) {
+			result = err;
+		}
+	}
+
+	lock_release(buf_lock);
+	return result;
+}
+
+/*
+ * Throw away the buffer for one block, if cached, without writing it
+ * back. For blocks the file system has just freed: a stale dirty copy
+ * must not land on the disk after the block has been reused, nor may
+ * a stale clean copy be handed back to its next owner.
+ */
+void
+buf_invalidate(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	buf_reap();
+	b = buf_lookup(dev, block);
+	while (b != NULL && b->b_busy) {
+		/* Still being written; let that finish first. */
+		buf_wait(b);
+		b = buf_lookup(dev, block);
+	}
+	if (b != NULL) {
+		KASSERT(b->b_refcount == 0);
+		buf_discard(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Throw away every buffer belonging to DEV. The caller should have
+ * synced the device first; nothing may be holding a reference.
+ */
+void
+buf_drop(struct device *dev)
+{
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	buf_reap();
+	for (i=0; i<BUF_NBUFS; i++) {
+		struct buf *b = &buf_pool[i];
+
+		while (b->b_dev == dev && b->b_busy) {
+			buf_wait(b);
+		}
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(b->b_refcount == 0);
+		KASSERT(!b->b_dirty);
+		buf_discard(b);
+	}
+	DEBUG(DB_VFS, "buf: %u hits, %u misses, %u writebacks, "
+	      "%u read ahead\n",
+	      buf_hits, buf_misses, buf_writebacks, buf_readaheads);
+	lock_release(buf_lock);
+}
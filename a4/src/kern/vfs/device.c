@@ -241,15 +241,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. The VM system maps files by reading and writing them a
+ * page at a time, which doesn't make sense for a device.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return ENODEV;
 }
 
 /*
@@ -463,3 +463,17 @@ dev_create_vnode(struct device *dev)
 
 	return v;
 }
+
+/*
+ * Return the device a vnode made by dev_create_vnode stands for, or
+ * NULL if V is some other kind of vnode. For code (such as swap) that
+ * wants to talk to the device directly.
+ */
+struct device *
+dev_vnode_device(struct vnode *v)
+{
+	if (v->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	return v->vn_data;
+}
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -109,6 +110,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buf_bootstrap();
+
 	devnull_create();
 }
 
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/mman.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
@@ -74,6 +75,15 @@ as_create(void)
 		kfree(as);
 		return NULL;
 	}
+	as->as_lastobj = NULL;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+
+	if (mmu_initas(as)) {
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
@@ -110,7 +120,7 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 	KASSERT(as == curthread->t_addrspace);
 
 
-	/* copy the vmos */
+	/* copy the vmos (in order, so the new array is sorted too) */
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
@@ -124,7 +134,12 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
 	}
+	newas->as_heapend = as->as_heapend;
 	
 	*ret = newas;
 	return 0;
@@ -134,6 +149,59 @@ fail:
 	return result;
 }
 
+/*
+ * as_findobj: find the vm_object that VA falls in, or NULL if there
+ * isn't one. Tries the one found last time first; otherwise does a
+ * binary search of as_objects, which is sorted by base address and
+ * whose objects don't overlap.
+ *
+ * Synchronization: none.
+ */
+static
+struct vm_object *
+as_findobj(struct addrspace *as, vaddr_t va)
+{
+	struct vm_object *vmo;
+	unsigned lo, hi, mid;
+	vaddr_t top;
+
+	vmo = as->as_lastobj;
+	if (vmo != NULL) {
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (va >= vmo->vmo_base && va < top) {
+			return vmo;
+		}
+	}
+
+	/* Find the first object based above VA... */
+	lo = 0;
+	hi = vm_object_array_num(as->as_objects);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		vmo = vm_object_array_get(as->as_objects, mid);
+		if (vmo->vmo_base <= va) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	/* ...and VA can only be in the one before it. */
+	if (lo == 0) {
+		return NULL;
+	}
+	vmo = vm_object_array_get(as->as_objects, lo - 1);
+	top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+	if (va >= top) {
+		return NULL;
+	}
+
+	as->as_lastobj = vmo;
+	return vmo;
+}
+
 /*
  * as_fault: fault handling. Handle a fault on an address space, of
  * specified type, at specified address.
@@ -144,35 +212,61 @@ fail:
 int
 as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 {
-	struct vm_object *faultobj = NULL;
+	struct vm_object *faultobj;
 	struct lpage *lp;
-	vaddr_t bot=0, top;
-	unsigned i, index;
+	unsigned index;
 	int result;
 
 	/* Find the vm_object concerned */
-	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
-		struct vm_object *vmo;
-
-		vmo = vm_object_array_get(as->as_objects, i);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-		if (va >= bot && va < top) {
-			faultobj = vmo;
-			break;
-		}
-	}
-
+	faultobj = as_findobj(as, va);
 	if (faultobj == NULL) {
 		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
 		return EFAULT;
 	}
 
+	if (faulttype != VM_FAULT_READ && faultobj->vmo_readonly) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: write to read-only va=0x%x\n",
+		      va);
+		return EFAULT;
+	}
+
+	/* Make sure there's page table space for the mapping. */
+	result = mmu_prepare(as, va);
+	if (result) {
+		return result;
+	}
+
 	/* Now get the logical page */
-	index = (va - bot) / PAGE_SIZE;
+	index = (va - faultobj->vmo_base) / PAGE_SIZE;
 	lp = lpage_array_get(faultobj->vmo_lpages, index);
 
-	if (lp == NULL) {
+	if (lp == NULL && faultobj->vmo_vnpages != NULL) {
+		/* first touch here of a page of a shared file mapping */
+		result = vnpages_getpage(faultobj->vmo_vnpages,
+			faultobj->vmo_fileoffset / PAGE_SIZE + index, &lp);
+		if (result) {
+			kprintf("vm: shared file fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	}
+	else if (lp == NULL && faulttype == VM_FAULT_READ &&
+	    (faultobj->vmo_vnode == NULL ||
+	     !vm_object_hasfiledata(faultobj, va))) {
+		/* read of a zero page never written: share the zero page */
+		mmu_map_zero(as, va);
+		return 0;
+	}
+	else if (lp == NULL && faultobj->vmo_vnode != NULL) {
+		/* first touch of a file page */
+		result = lpage_fileload(faultobj, va, &lp);
+		if (result) {
+			kprintf("vm: file fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	}
+	else if (lp == NULL) {
 		/* zerofill page */
 		result = lpage_zerofill(&lp);
 		if (result) {
@@ -181,8 +275,82 @@ as_fault(struct addrspace *as, int faulttype, vaddr_t va)
 		}
 		lpage_array_set(faultobj->vmo_lpages, index, lp);
 	}
+	else if (faulttype != VM_FAULT_READ && lpage_isshared(lp)) {
+		/* Write to a copy-on-write page; get our own copy. */
+		result = lpage_unshare(lp, as, va & PAGE_FRAME, &lp);
+		if (result) {
+			kprintf("vm: copy-on-write fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	}
 	
-	return lpage_fault(lp, as, faulttype, va);
+	result = lpage_fault(lp, faultobj, as, faulttype, va);
+	if (result) {
+		return result;
+	}
+
+	/* If this looks like a sequential scan, read ahead from swap. */
+	vm_object_fault_around(faultobj, index);
+	return 0;
+}
+
+/*
+ * as_sbrk: move the break (the end of the heap) by AMOUNT bytes, up
+ * or down, and hand back the old one in OLDBREAK. The heap vm_object
+ * covers whole pages; growing it reserves swap for the new pages, and
+ * shrinking it frees the pages dropped, and their swap.
+ *
+ * Synchronization: none. We assume the address space is not shared.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct vm_object *heap = as->as_heap;
+	struct vm_object *vmo;
+	vaddr_t newend, limit;
+	unsigned i, npages;
+	int result;
+
+	if (heap == NULL) {
+		/* no executable loaded, so no heap */
+		return ENOMEM;
+	}
+
+	if (amount < 0) {
+		if ((vaddr_t)0 - (vaddr_t)amount >
+		    as->as_heapend - heap->vmo_base) {
+			/* would go below the start of the heap */
+			return EINVAL;
+		}
+	}
+	newend = as->as_heapend + amount;
+	if (amount > 0 && newend < as->as_heapend) {
+		return ENOMEM;
+	}
+
+	/* Don't run into whatever is above the heap, or its redzone. */
+	limit = USERSPACETOP;
+	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		if (vmo != heap && vmo->vmo_base >= heap->vmo_base) {
+			limit = vmo->vmo_base - vmo->vmo_lower_redzone;
+			break;
+		}
+	}
+	if (newend > limit) {
+		return ENOMEM;
+	}
+
+	npages = ROUNDUP(newend - heap->vmo_base, PAGE_SIZE) / PAGE_SIZE;
+	result = vm_object_setsize(as, heap, npages);
+	if (result) {
+		return result;
+	}
+
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newend;
+	return 0;
 }
 
 /*
@@ -200,8 +368,10 @@ as_destroy(struct addrspace *as)
 		vm_object_destroy(as, vmo);
 	}
 
+	as->as_lastobj = NULL;
 	vm_object_array_setsize(as->as_objects, 0);
 	vm_object_array_destroy(as->as_objects);
+	mmu_cleanupas(as);
 	kfree(as);
 }
 
@@ -220,31 +390,48 @@ as_activate(struct addrspace *as)
 }
 
 /*
- * Set up a segment at virtual address VADDR of size MEMSIZE. The
- * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
- *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored.
- *
- * Does not allow overlapping regions.
+ * as_objtop: return the address just past the pages of VMO. The heap
+ * counts as having at least one page even when it's empty, so that
+ * nothing else is put where it would grow.
+ */
+static
+vaddr_t
+as_objtop(struct addrspace *as, struct vm_object *vmo)
+{
+	vaddr_t top;
+
+	top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+	if (vmo == as->as_heap && top == vmo->vmo_base) {
+		top += PAGE_SIZE;
+	}
+	return top;
+}
+
+/*
+ * as_add_region: common code for as_define_region and
+ * as_define_fileregion. Checks that the pages covering VADDR..VADDR+SZ,
+ * plus the redzone below, don't overlap anything, then makes a vm_object
+ * for them and adds it to the address space. If V is not NULL, the
+ * object is backed by the file (see vm_object_create_file), or if
+ * SHARED is set, maps the file's shared pages (vm_object_create_shared).
+ * Hands back the new object in RET, if that isn't NULL.
  */
+static
 int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 size_t lower_redzone,
-		 int readable, int writeable, int executable)
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	      size_t lower_redzone, struct vnode *v, off_t offset,
+	      size_t filesize, bool readonly, bool shared,
+	      struct vm_object **ret)
 {
-	struct vm_object *vmo;
+	struct vm_object *vmo, *other;
+	struct vnpages *vnp;
 	unsigned i;
 	int result;
 	vaddr_t check_vaddr;	/* vaddr to use for overlap check */
+	vaddr_t filevaddr = vaddr;
 
-	(void)readable;
-	(void)writeable;	// XXX
-	(void)executable;
-
-	/* align base address */
+	/* align base address, keeping the part of the page below it */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
 
 	/* redzone must be aligned */
@@ -266,7 +453,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		vmo = vm_object_array_get(as->as_objects, i);
 		KASSERT(vmo != NULL);
 		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		top = as_objtop(as, vmo);
 
 		/* Check guard band, if any */
 		KASSERT(bot >= vmo->vmo_lower_redzone);
@@ -279,22 +466,248 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	}
 
 
-	/* Create a new vmo. All pages are marked zerofilled. */
-	vmo = vm_object_create(sz/PAGE_SIZE);
+	/* Create a new vmo. All pages are marked zerofilled (or unread). */
+	if (v != NULL && shared) {
+		vnp = vnpages_get(v);
+		if (vnp == NULL) {
+			return ENOMEM;
+		}
+		vmo = vm_object_create_shared(sz/PAGE_SIZE, vnp, offset,
+					      readonly);
+		/* the vmo has its own reference, if it was made */
+		vnpages_decref(vnp);
+	}
+	else if (v != NULL) {
+		vmo = vm_object_create_file(sz/PAGE_SIZE, v, offset,
+					    filevaddr, filesize, readonly);
+	}
+	else {
+		vmo = vm_object_create(sz/PAGE_SIZE);
+	}
 	if (vmo == NULL) {
 		return ENOMEM;
 	}
 	vmo->vmo_base = vaddr;
 	vmo->vmo_lower_redzone = lower_redzone;
 
-	/* Add it to the parent address space. */
+	/* Add it to the parent address space, keeping it sorted. */
 	result = vm_object_array_add(as->as_objects, vmo, NULL);
 	if (result) {
 		vm_object_destroy(as, vmo);
 		return result;
 	}
+	for (i = vm_object_array_num(as->as_objects) - 1; i > 0; i--) {
+		other = vm_object_array_get(as->as_objects, i - 1);
+		if (other->vmo_base < vaddr) {
+			break;
+		}
+		vm_object_array_set(as->as_objects, i, other);
+	}
+	vm_object_array_set(as->as_objects, i, vmo);
 
 	/* Done */
+	if (ret != NULL) {
+		*ret = vmo;
+	}
+	return 0;
+}
+
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE.
+ *
+ * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
+ * write, or execute permission should be set on the segment. At the
+ * moment, these are ignored.
+ *
+ * Does not allow overlapping regions.
+ */
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 size_t lower_redzone,
+		 int readable, int writeable, int executable)
+{
+	(void)readable;
+	(void)writeable;	// XXX
+	(void)executable;
+
+	return as_add_region(as, vaddr, sz, lower_redzone,
+			     NULL, 0, 0, false, false, NULL);
+}
+
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE whose
+ * first FILESIZE bytes come from vnode V at offset OFFSET, as for an
+ * executable's segment. Nothing is read now; each page is read from
+ * the file the first time it is touched.
+ *
+ * If WRITEABLE is not set, writes to the segment fault, and its pages
+ * use no swap: when evicted they are dropped and later read from the
+ * file again. Otherwise the pages are private copies once loaded and
+ * go to swap like anonymous memory. READABLE and EXECUTABLE are
+ * ignored.
+ *
+ * Does not allow overlapping regions.
+ */
+int
+as_define_fileregion(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		     struct vnode *v, off_t offset, size_t filesize,
+		     int readable, int writeable, int executable)
+{
+	(void)readable;
+	(void)executable;
+
+	KASSERT(filesize <= memsize);
+
+	return as_add_region(as, vaddr, memsize, 0, v, offset, filesize,
+			     !writeable, false, NULL);
+}
+
+/*
+ * as_findgap: find room for SZ bytes (a whole number of pages) that
+ * don't run into any object or its redzone, as high up as possible
+ * so the heap has the most room to grow. Page 0 stays unmapped.
+ *
+ * Synchronization: none.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t sz, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	unsigned i;
+	vaddr_t limit, top;
+
+	/* Work down from the top, through the gap below each object. */
+	limit = USERSPACETOP;
+	for (i = vm_object_array_num(as->as_objects); i > 0; i--) {
+		vmo = vm_object_array_get(as->as_objects, i - 1);
+		top = as_objtop(as, vmo);
+		if (limit >= top && limit - top >= sz) {
+			*ret = limit - sz;
+			return 0;
+		}
+		limit = vmo->vmo_base - vmo->vmo_lower_redzone;
+	}
+	if (limit >= PAGE_SIZE && limit - PAGE_SIZE >= sz) {
+		*ret = limit - sz;
+		return 0;
+	}
+	return ENOMEM;
+}
+
+/*
+ * as_mmap: map LEN bytes at VADDR, or anywhere there's room unless
+ * MAP_FIXED is in FLAGS, and hand back where it went in RET. If V is
+ * NULL the pages are zero-filled; otherwise the first FILESIZE bytes
+ * come from V at OFFSET, read as they're touched, as for a program's
+ * segment. If PROT_WRITE isn't in PROT such a file mapping can't be
+ * written and uses no swap; the other protections are ignored.
+ *
+ * A MAP_SHARED file mapping maps the same pages as every other shared
+ * mapping of the file, and stores to it reach the file. FILESIZE
+ * doesn't matter for it; the whole page is shared, and only the part
+ * inside the file is ever written back.
+ *
+ * MAP_FIXED won't replace pages already mapped.
+ *
+ * Synchronization: none. We assume the address space is not shared.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	int flags, struct vnode *v, off_t offset, size_t filesize,
+	vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	int result;
+
+	KASSERT(filesize <= len);
+
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (len == 0) {
+		return EINVAL;
+	}
+
+	if (flags & MAP_FIXED) {
+		if ((vaddr & PAGE_FRAME) != vaddr || vaddr == 0 ||
+		    vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+			return EINVAL;
+		}
+	}
+	else {
+		result = as_findgap(as, len, &vaddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_add_region(as, vaddr, len, 0, v, offset, filesize,
+			       v != NULL && (prot & PROT_WRITE) == 0,
+			       (flags & MAP_TYPE) == MAP_SHARED, &vmo);
+	if (result) {
+		return result;
+	}
+	vmo->vmo_mapped = true;
+
+	*ret = vaddr;
+	return 0;
+}
+
+/*
+ * as_munmap: remove the mappings made by as_mmap in the LEN bytes at
+ * VADDR. Each must be removed whole; we don't split them. Pages of a
+ * shared file mapping are written back once no mapping of them is
+ * left (see vnpages_decref).
+ *
+ * Synchronization: none. We assume the address space is not shared.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_object *vmo;
+	vaddr_t end, top;
+	unsigned i;
+
+	len = ROUNDUP(len, PAGE_SIZE);
+	if ((vaddr & PAGE_FRAME) != vaddr || len == 0 ||
+	    vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	end = vaddr + len;
+
+	/* Check everything first, so we fail without changing anything. */
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top <= vaddr || vmo->vmo_base >= end ||
+		    top == vmo->vmo_base) {
+			/* no overlap (an empty heap never overlaps) */
+			continue;
+		}
+		if (!vmo->vmo_mapped ||
+		    vmo->vmo_base < vaddr || top > end) {
+			return EINVAL;
+		}
+	}
+
+	i = 0;
+	while (i < vm_object_array_num(as->as_objects)) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top <= vaddr || vmo->vmo_base >= end ||
+		    top == vmo->vmo_base) {
+			i++;
+			continue;
+		}
+		vm_object_array_remove(as->as_objects, i);
+		if (as->as_lastobj == vmo) {
+			as->as_lastobj = NULL;
+		}
+		vm_object_destroy(as, vmo);
+	}
 	return 0;
 }
 
@@ -313,16 +726,35 @@ as_prepare_load(struct addrspace *as)
 }
 
 /*
- * as_complete_load: called after loading executable segments.
+ * as_complete_load: called after loading executable segments. Sets
+ * up the heap, empty to begin with, on the page after the highest
+ * segment. (The stack comes later, far above.)
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	unsigned num;
+	vaddr_t heapbase;
+	int result;
 
-	(void)as;
+	KASSERT(as->as_heap == NULL);
+
+	heapbase = 0;
+	num = vm_object_array_num(as->as_objects);
+	if (num > 0) {
+		/* the array is sorted, so the last one is highest */
+		vmo = vm_object_array_get(as->as_objects, num - 1);
+		heapbase = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+	}
+
+	result = as_add_region(as, heapbase, 0, 0, NULL, 0, 0, false, false,
+			       &as->as_heap);
+	if (result) {
+		return result;
+	}
+	as->as_heapend = heapbase;
 	return 0;
 }
 
@@ -30,6 +30,9 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -189,16 +192,102 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. The per-cpu part
+ * is the magazine layer in front of it (below), which mostly keeps
+ * kmalloc and kfree from getting here at all.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Hash table from page address to pageref, so kfree can find the
+ * page (and thus the size) of a block without walking allbase. It's
+ * open-addressed; a removed entry becomes PAGEHASH_DEAD, unless
+ * nothing is chained through it, so a search can stop at NULL.
+ *
+ * Changes are made with kmalloc_spinlock held, but kfree looks up
+ * blocks without it. That's safe because while a block is allocated
+ * its page's entry can't move or go away, and no entry on the way to
+ * it can become NULL.
+ */
+#define NPAGEHASH	(2*NPAGEREFS)
+#define PAGEHASH_DEAD	((struct pageref *)1)
+static struct pageref *volatile pagehash[NPAGEHASH];
+
+#define PAGEHASH_START(page)	(((page) / PAGE_SIZE) % NPAGEHASH)
+
+static
+void
+pagehash_add(struct pageref *pr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = PAGEHASH_START(PR_PAGEADDR(pr));
+	while (pagehash[i] != NULL && pagehash[i] != PAGEHASH_DEAD) {
+		i = (i + 1) % NPAGEHASH;
+	}
+	pagehash[i] = pr;
+}
+
+static
+void
+pagehash_remove(struct pageref *pr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = PAGEHASH_START(PR_PAGEADDR(pr));
+	while (pagehash[i] != pr) {
+		KASSERT(pagehash[i] != NULL);
+		i = (i + 1) % NPAGEHASH;
+	}
+
+	if (pagehash[(i + 1) % NPAGEHASH] != NULL) {
+		/* someone may be chained through here */
+		pagehash[i] = PAGEHASH_DEAD;
+		return;
+	}
+
+	/* nobody is; clear this and any dead entries before it */
+	do {
+		pagehash[i] = NULL;
+		i = (i + NPAGEHASH - 1) % NPAGEHASH;
+	} while (pagehash[i] == PAGEHASH_DEAD);
+}
+
+/*
+ * pagehash_find: return the pageref for PAGE, or NULL if it isn't a
+ * subpage allocator page. Needs no lock if PAGE has a block in use
+ * (or can't be a subpage page at all).
+ */
+static
+struct pageref *
+pagehash_find(vaddr_t page)
+{
+	struct pageref *pr;
+	unsigned i, n;
+
+	i = PAGEHASH_START(page);
+	for (n = 0; n < NPAGEHASH; n++) {
+		pr = pagehash[i];
+		if (pr == NULL) {
+			break;
+		}
+		if (pr != PAGEHASH_DEAD && PR_PAGEADDR(pr) == page) {
+			return pr;
+		}
+		i = (i + 1) % NPAGEHASH;
+	}
+	return NULL;
+}
+
+////////////////////////////////////////
+
 /* SLOWER implies SLOW */
 #ifdef SLOWER
 #ifndef SLOW
@@ -279,6 +368,11 @@ checksubpages(void)
 
 ////////////////////////////////////////
 
+static void mag_drain(void);
+static unsigned mag_markfree(vaddr_t prpage, unsigned blktype,
+			     uint32_t *freemap);
+static void depot_printstats(void);
+
 static
 void
 dumpsubpage(struct pageref *pr)
@@ -286,7 +380,7 @@ dumpsubpage(struct pageref *pr)
 	vaddr_t prpage, fla;
 	struct freelist *fl;
 	int blktype;
-	unsigned i, n, index;
+	unsigned i, n, index, nfree;
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
@@ -315,10 +409,11 @@ dumpsubpage(struct pageref *pr)
 			freemap[index/32] |= (1<<(index%32));
 		}
 	}
+	nfree = pr->nfree + mag_markfree(prpage, blktype, freemap);
 
 	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n", 
 		(unsigned long)prpage, (unsigned long) sizes[blktype],
-		(unsigned) pr->nfree, n);
+		nfree, n);
 	kprintf("   ");
 	for (i=0; i<n; i++) {
 		int val = (freemap[i/32] & (1<<(i%32)))!=0;
@@ -330,11 +425,20 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Print the state of the kernel heap. Blocks sitting in magazines are
+ * free as far as kmalloc's callers are concerned, so they're shown as
+ * free: first the ones we can reach are given back to their pages,
+ * and the rest (in other cpus' magazines) are marked free as the
+ * pages are printed.
+ */
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	mag_drain();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -345,6 +449,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	depot_printstats();
 }
 
 ////////////////////////////////////////
@@ -504,6 +610,8 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pagehash_add(pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -526,24 +634,18 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = pagehash_find(ptraddr & PAGE_FRAME);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
 	offset = ptraddr - prpage;
 
@@ -553,10 +655,9 @@ subpage_kfree(void *ptr)
 	}
 
 	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
+	 * The block was cleared to 0xdeadbeef by kfree, when it was
+	 * freed, to make it easier to detect uses of dangling pointers.
 	 */
-	fill_deadbeef(ptr, sizes[blktype]);
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -577,6 +678,7 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		pagehash_remove(pr);
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
@@ -598,9 +700,531 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Magazine layer.
+//
+// In front of the subpage allocator, each cpu keeps two "magazines"
+// of free blocks for each size, and kmalloc and kfree use those with
+// interrupts off and no lock at all. When both are empty (for
+// kmalloc) or full (for kfree), one is traded at the depot, which
+// holds full and empty magazines for all cpus, for a full or empty
+// one. Only if the depot is out too do we go to the subpage
+// allocator; and then kmalloc takes a magazine's worth of blocks, so
+// the next few calls on this cpu (or another) don't have to.
+// Keeping two magazines means a cpu bouncing between allocating and
+// freeing around a magazine boundary doesn't trade every time. This
+// is the design from Bonwick and Adams, "Magazines and Vmem" (2001).
+//
+// A magazine holds about a page's worth of blocks of its size
+// (mag_maxrounds), so trading one with the depot moves a similar
+// amount of memory whatever the size: many rounds for small blocks,
+// which are cheap to hold and churn quickly, and only a few for big
+// ones, which would otherwise tie up several pages per magazine. For
+// the smallest sizes a page is hundreds of blocks, so the count is
+// capped at MAG_MAXROUNDS. Each magazine is allocated at the size its
+// count needs.
+//
+// kfree never allocates a magazine, since it may be called holding
+// spinlocks; if there's nowhere to put a block, it goes back to the
+// subpage allocator. Magazines are made by kmalloc, which may sleep
+// anyway. The depot keeps at most DEPOT_MAXFULL full magazines of
+// each size (so about that many pages); more than that go back to the
+// subpage allocator, so memory freed on one cpu isn't hoarded. And
+// when the VM system runs out of pages for the kernel it calls
+// kheap_reclaim, which empties the depot and this cpu's magazines.
+//
+
+#define MAG_MAXROUNDS	62	/* makes the biggest magazine 256 bytes */
+#define DEPOT_MAXFULL	2
+
+struct magazine {
+	struct magazine *mag_next;	/* in the depot */
+	unsigned mag_nrounds;
+	void *mag_rounds[];		/* mag_maxrounds() of them */
+};
+
+#define MAG_SIZE(rounds) \
+	(sizeof(struct magazine) + (rounds) * sizeof(void *))
+
+/* Per-cpu; curcpu->c_kmalloc. */
+struct kmalloc_cpu {
+	struct magazine *kc_loaded[NSIZES];
+	struct magazine *kc_previous[NSIZES];
+	struct kmalloc_cpu *kc_next;	/* on kc_all */
+};
+
+/* The depot, and the list of every cpu's magazines. */
+static struct spinlock depot_spinlock = SPINLOCK_INITIALIZER;
+static struct magazine *depot_full[NSIZES];
+static struct magazine *depot_empty[NSIZES];
+static unsigned depot_nfull[NSIZES];
+static unsigned depot_nempty[NSIZES];
+static struct kmalloc_cpu *kc_all;
+
+/*
+ * mag_maxrounds: how many blocks a magazine of size sizes[BLKTYPE]
+ * holds.
+ */
+static
+unsigned
+mag_maxrounds(unsigned blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype];
+	return n < MAG_MAXROUNDS ? n : MAG_MAXROUNDS;
+}
+
+/*
+ * depot_put: return MAG to the depot.
+ */
+static
+void
+depot_put(unsigned blktype, struct magazine *mag)
+{
+	spinlock_acquire(&depot_spinlock);
+	if (mag->mag_nrounds == 0) {
+		mag->mag_next = depot_empty[blktype];
+		depot_empty[blktype] = mag;
+		depot_nempty[blktype]++;
+	}
+	else {
+		mag->mag_next = depot_full[blktype];
+		depot_full[blktype] = mag;
+		depot_nfull[blktype]++;
+	}
+	spinlock_release(&depot_spinlock);
+}
+
+/*
+ * mag_unload: give the blocks in this cpu's magazines for size
+ * sizes[BLKTYPE] back to the subpage allocator. One at a time, since
+ * a magazine can hold a lot of them and this may be called deep in
+ * the stack (see kheap_reclaim).
+ */
+static
+void
+mag_unload(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	void *ptr;
+	int spl, result;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	while (1) {
+		ptr = NULL;
+		spl = splhigh();
+		kc = curcpu->c_kmalloc;
+		if (kc != NULL) {
+			mag = kc->kc_loaded[blktype];
+			if (mag == NULL || mag->mag_nrounds == 0) {
+				mag = kc->kc_previous[blktype];
+			}
+			if (mag != NULL && mag->mag_nrounds > 0) {
+				ptr = mag->mag_rounds[--mag->mag_nrounds];
+			}
+		}
+		splx(spl);
+
+		if (ptr == NULL) {
+			break;
+		}
+		result = subpage_kfree(ptr);
+		KASSERT(result == 0);
+	}
+}
+
+/*
+ * mag_drain: for kheap_printstats and kheap_reclaim. Give the blocks
+ * in this cpu's magazines and in the depot's full magazines back to
+ * the subpage allocator. Other cpus' magazines are only touched by
+ * those cpus.
+ */
+static
+void
+mag_drain(void)
+{
+	struct magazine *mag;
+	unsigned blktype, i;
+	int result;
+
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		mag_unload(blktype);
+
+		while (1) {
+			spinlock_acquire(&depot_spinlock);
+			mag = depot_full[blktype];
+			if (mag != NULL) {
+				depot_full[blktype] = mag->mag_next;
+				depot_nfull[blktype]--;
+			}
+			spinlock_release(&depot_spinlock);
+			if (mag == NULL) {
+				break;
+			}
+			for (i=0; i<mag->mag_nrounds; i++) {
+				result = subpage_kfree(mag->mag_rounds[i]);
+				KASSERT(result == 0);
+			}
+			mag->mag_nrounds = 0;
+			depot_put(blktype, mag);
+		}
+	}
+}
+
+/*
+ * kheap_reclaim: called by the VM system when it can't find a page
+ * for the kernel. Give everything the magazine layer can spare back
+ * to the subpage allocator, which frees any page that ends up with no
+ * blocks in use: the blocks in this cpu's magazines and the depot's,
+ * and the depot's empty magazines themselves. Doesn't sleep, but
+ * takes kmalloc's spinlocks and (to free pages) coremap_spinlock.
+ */
+void
+kheap_reclaim(void)
+{
+	struct magazine *mag;
+	unsigned blktype;
+	int result;
+
+	mag_drain();
+
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		while (1) {
+			spinlock_acquire(&depot_spinlock);
+			mag = depot_empty[blktype];
+			if (mag != NULL) {
+				depot_empty[blktype] = mag->mag_next;
+				depot_nempty[blktype]--;
+			}
+			spinlock_release(&depot_spinlock);
+			if (mag == NULL) {
+				break;
+			}
+			result = subpage_kfree(mag);
+			KASSERT(result == 0);
+		}
+	}
+}
+
+/*
+ * mag_markmag: mark the blocks of MAG that are on page PRPAGE in
+ * FREEMAP, if they aren't already, and return how many that was.
+ */
+static
+unsigned
+mag_markmag(struct magazine *mag, vaddr_t prpage, unsigned blktype,
+	    uint32_t *freemap)
+{
+	vaddr_t ptr;
+	unsigned i, n, index, count;
+
+	if (mag == NULL) {
+		return 0;
+	}
+	count = 0;
+	n = mag->mag_nrounds;
+	for (i=0; i<n && i<mag_maxrounds(blktype); i++) {
+		ptr = (vaddr_t)mag->mag_rounds[i];
+		if ((ptr & PAGE_FRAME) != prpage) {
+			continue;
+		}
+		index = (ptr - prpage) / sizes[blktype];
+		if ((freemap[index/32] & (1<<(index%32))) == 0) {
+			freemap[index/32] |= (1<<(index%32));
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * mag_markfree: for dumpsubpage. Mark the blocks of page PRPAGE that
+ * are in magazines in FREEMAP, and return how many there were.
+ *
+ * Other cpus change their own magazines without locking, so what we
+ * see of those may be a little out of date; this is only for
+ * printing.
+ */
+static
+unsigned
+mag_markfree(vaddr_t prpage, unsigned blktype, uint32_t *freemap)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	unsigned count;
+
+	count = 0;
+	spinlock_acquire(&depot_spinlock);
+	for (kc = kc_all; kc != NULL; kc = kc->kc_next) {
+		count += mag_markmag(kc->kc_loaded[blktype], prpage, blktype,
+				     freemap);
+		count += mag_markmag(kc->kc_previous[blktype], prpage,
+				     blktype, freemap);
+	}
+	for (mag = depot_full[blktype]; mag != NULL; mag = mag->mag_next) {
+		count += mag_markmag(mag, prpage, blktype, freemap);
+	}
+	spinlock_release(&depot_spinlock);
+	return count;
+}
+
+/*
+ * depot_printstats: for kheap_printstats.
+ */
+static
+void
+depot_printstats(void)
+{
+	unsigned i, nfull[NSIZES], nempty[NSIZES];
+
+	spinlock_acquire(&depot_spinlock);
+	for (i=0; i<NSIZES; i++) {
+		nfull[i] = depot_nfull[i];
+		nempty[i] = depot_nempty[i];
+	}
+	spinlock_release(&depot_spinlock);
+
+	kprintf("Magazine depot (full/empty, of so many blocks; cpus "
+		"hold up to two more of each size):\n");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("   size %-4lu  %u/%u  x%u\n", (unsigned long)sizes[i],
+			nfull[i], nempty[i], mag_maxrounds(i));
+	}
+}
+
+/*
+ * mag_kmalloc: get a block of size sizes[BLKTYPE] from this cpu's
+ * magazines, or NULL if there isn't one handy.
+ */
+static
+void *
+mag_kmalloc(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag, *prev;
+	void *ptr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* too early */
+		return NULL;
+	}
+
+	/* Keep us on this cpu, and interrupt handlers off the magazines. */
+	spl = splhigh();
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		splx(spl);
+		return NULL;
+	}
+
+	while (1) {
+		mag = kc->kc_loaded[blktype];
+		if (mag != NULL && mag->mag_nrounds > 0) {
+			ptr = mag->mag_rounds[--mag->mag_nrounds];
+			splx(spl);
+			return ptr;
+		}
+
+		prev = kc->kc_previous[blktype];
+		if (prev != NULL && prev->mag_nrounds > 0) {
+			kc->kc_loaded[blktype] = prev;
+			kc->kc_previous[blktype] = mag;
+			continue;
+		}
+
+		/* Both empty; trade one for a full one. */
+		spinlock_acquire(&depot_spinlock);
+		if (depot_full[blktype] == NULL) {
+			spinlock_release(&depot_spinlock);
+			break;
+		}
+		kc->kc_loaded[blktype] = depot_full[blktype];
+		depot_full[blktype] = depot_full[blktype]->mag_next;
+		depot_nfull[blktype]--;
+		if (prev != NULL) {
+			prev->mag_next = depot_empty[blktype];
+			depot_empty[blktype] = prev;
+			depot_nempty[blktype]++;
+		}
+		spinlock_release(&depot_spinlock);
+		kc->kc_previous[blktype] = mag;
+	}
+
+	splx(spl);
+	return NULL;
+}
+
+/*
+ * mag_kfree: put block PTR of size sizes[BLKTYPE] in this cpu's
+ * magazines. Returns false if there's no room.
+ */
+static
+bool
+mag_kfree(void *ptr, unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag, *prev, *flush;
+	unsigned i, max;
+	int spl, result;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	max = mag_maxrounds(blktype);
+
+	spl = splhigh();
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		splx(spl);
+		return false;
+	}
+
+	flush = NULL;
+	while (1) {
+		mag = kc->kc_loaded[blktype];
+		if (mag != NULL && mag->mag_nrounds < max) {
+			mag->mag_rounds[mag->mag_nrounds++] = ptr;
+			break;
+		}
+
+		prev = kc->kc_previous[blktype];
+		if (prev != NULL && prev->mag_nrounds < max) {
+			kc->kc_loaded[blktype] = prev;
+			kc->kc_previous[blktype] = mag;
+			continue;
+		}
+
+		/* Both full (or missing); trade one for an empty one. */
+		spinlock_acquire(&depot_spinlock);
+		if (depot_empty[blktype] == NULL) {
+			spinlock_release(&depot_spinlock);
+			splx(spl);
+			return false;
+		}
+		kc->kc_loaded[blktype] = depot_empty[blktype];
+		depot_empty[blktype] = depot_empty[blktype]->mag_next;
+		depot_nempty[blktype]--;
+		if (prev != NULL) {
+			if (depot_nfull[blktype] < DEPOT_MAXFULL) {
+				prev->mag_next = depot_full[blktype];
+				depot_full[blktype] = prev;
+				depot_nfull[blktype]++;
+			}
+			else {
+				KASSERT(flush == NULL);
+				flush = prev;
+			}
+		}
+		spinlock_release(&depot_spinlock);
+		kc->kc_previous[blktype] = mag;
+	}
+	splx(spl);
+
+	if (flush != NULL) {
+		/* The depot has plenty; give the blocks back. */
+		for (i=0; i<flush->mag_nrounds; i++) {
+			result = subpage_kfree(flush->mag_rounds[i]);
+			KASSERT(result == 0);
+		}
+		flush->mag_nrounds = 0;
+		depot_put(blktype, flush);
+	}
+	return true;
+}
+
+/*
+ * mag_refill: get a block of size sizes[BLKTYPE] from the subpage
+ * allocator, along with a magazine full of more for the depot.
+ * Also sets up this cpu's magazines if it hasn't any yet.
+ */
+static
+void *
+mag_refill(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct magazine *mag;
+	unsigned max;
+	void *ptr;
+	int spl, result;
+
+	if (!CURCPU_EXISTS()) {
+		return subpage_kmalloc(sizes[blktype]);
+	}
+	max = mag_maxrounds(blktype);
+
+	if (curcpu->c_kmalloc == NULL) {
+		kc = subpage_kmalloc(sizeof(*kc));
+		if (kc != NULL) {
+			bzero(kc, sizeof(*kc));
+			/* we may have moved cpus while sleeping */
+			spl = splhigh();
+			if (curcpu->c_kmalloc == NULL) {
+				curcpu->c_kmalloc = kc;
+				spinlock_acquire(&depot_spinlock);
+				kc->kc_next = kc_all;
+				kc_all = kc;
+				spinlock_release(&depot_spinlock);
+				kc = NULL;
+			}
+			splx(spl);
+			if (kc != NULL) {
+				result = subpage_kfree(kc);
+				KASSERT(result == 0);
+			}
+		}
+	}
+
+	spinlock_acquire(&depot_spinlock);
+	mag = depot_empty[blktype];
+	if (mag != NULL) {
+		depot_empty[blktype] = mag->mag_next;
+		depot_nempty[blktype]--;
+	}
+	spinlock_release(&depot_spinlock);
+
+	if (mag == NULL) {
+		mag = subpage_kmalloc(MAG_SIZE(max));
+		if (mag == NULL) {
+			return subpage_kmalloc(sizes[blktype]);
+		}
+		mag->mag_nrounds = 0;
+	}
+	KASSERT(mag->mag_nrounds == 0);
+
+	while (mag->mag_nrounds < max) {
+		ptr = subpage_kmalloc(sizes[blktype]);
+		if (ptr == NULL) {
+			break;
+		}
+		mag->mag_rounds[mag->mag_nrounds++] = ptr;
+	}
+
+	if (mag->mag_nrounds == 0) {
+		/* out of memory */
+		depot_put(blktype, mag);
+		return NULL;
+	}
+	ptr = mag->mag_rounds[--mag->mag_nrounds];
+	depot_put(blktype, mag);
+	return ptr;
+}
+
+//
+////////////////////////////////////////////////////////////
+
 void *
 kmalloc(size_t sz)
 {
+	unsigned blktype;
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -615,20 +1239,51 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	blktype = blocktype(sz);
+	ptr = mag_kmalloc(blktype);
+	if (ptr == NULL) {
+		ptr = mag_refill(blktype);
+	}
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct pageref *pr;
+	unsigned blktype;
+	int result;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	/*
+	 * Find which page it's on; if none of ours, it must be a big
+	 * allocation.
+	 */
+	pr = pagehash_find((vaddr_t)ptr & PAGE_FRAME);
+	if (pr == NULL) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
+		return;
 	}
-}
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
 
+	if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers. This is done here, once, whether
+	 * the block goes into a magazine or back to its page.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (!mag_kfree(ptr, blktype)) {
+		result = subpage_kfree(ptr);
+		KASSERT(result == 0);
+	}
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmem_cache.h.
+ *
+ * Each cache keeps up to KMEM_CACHE_MAXFREE freed objects, still
+ * constructed, in a small stack under its own spinlock; allocation
+ * takes one from there if it can, so the common case costs neither a
+ * constructor nor a trip through kmalloc. Past that many, freed
+ * objects are destroyed and go back to kmalloc, so a burst of
+ * allocations doesn't leave memory tied up for good.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+#define KMEM_CACHE_MAXFREE	32
+
+struct kmem_cache {
+	const char *kmc_name;
+	size_t kmc_size;
+	int (*kmc_ctor)(void *obj);
+	void (*kmc_dtor)(void *obj);
+
+	struct spinlock kmc_lock;
+	unsigned kmc_nlive;		/* objects handed out */
+	unsigned kmc_nfree;		/* entries in kmc_free[] */
+	void *kmc_free[KMEM_CACHE_MAXFREE];
+};
+
+/*
+ * Create a cache.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kmc_name = name;
+	kc->kmc_size = size;
+	kc->kmc_ctor = ctor;
+	kc->kmc_dtor = dtor;
+	spinlock_init(&kc->kmc_lock);
+	kc->kmc_nlive = 0;
+	kc->kmc_nfree = 0;
+	return kc;
+}
+
+/*
+ * Get an object: a cached one if there is one, or else a new one.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kmc_lock);
+	kc->kmc_nlive++;
+	if (kc->kmc_nfree > 0) {
+		obj = kc->kmc_free[--kc->kmc_nfree];
+		spinlock_release(&kc->kmc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kmc_lock);
+
+	obj = kmalloc(kc->kmc_size);
+	if (obj != NULL && kc->kmc_ctor != NULL) {
+		result = kc->kmc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			obj = NULL;
+		}
+	}
+
+	if (obj == NULL) {
+		spinlock_acquire(&kc->kmc_lock);
+		kc->kmc_nlive--;
+		spinlock_release(&kc->kmc_lock);
+	}
+	return obj;
+}
+
+/*
+ * Give an object back. Keep it if there's room; otherwise destroy it.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kc->kmc_lock);
+	KASSERT(kc->kmc_nlive > 0);
+	kc->kmc_nlive--;
+	if (kc->kmc_nfree < KMEM_CACHE_MAXFREE) {
+		kc->kmc_free[kc->kmc_nfree++] = obj;
+		spinlock_release(&kc->kmc_lock);
+		return;
+	}
+	spinlock_release(&kc->kmc_lock);
+
+	if (kc->kmc_dtor != NULL) {
+		kc->kmc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Destroy a cache, and whatever objects it's holding.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	unsigned i;
+
+	if (kc->kmc_nlive != 0) {
+		panic("kmem_cache_destroy: %s: %u objects still in use\n",
+		      kc->kmc_name, kc->kmc_nlive);
+	}
+
+	for (i=0; i<kc->kmc_nfree; i++) {
+		if (kc->kmc_dtor != NULL) {
+			kc->kmc_dtor(kc->kmc_free[i]);
+		}
+		kfree(kc->kmc_free[i]);
+	}
+	spinlock_cleanup(&kc->kmc_lock);
+	kfree(kc);
+}
@@ -36,18 +36,30 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
+#include <kmem_cache.h>
 #include <machine/coremap.h>
 
 /* 
  * lpage operations
  */
 
+/*
+ * One lpage is made for every page of user memory materialized, so
+ * keep them in a cache with their spinlocks already set up.
+ */
+static struct kmem_cache *lpage_cache;
+
 /* Stats counters */
 static volatile uint32_t ct_zerofills;
+static volatile uint32_t ct_fileloads;
 static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_cluster_writes;
+static volatile uint32_t ct_prefetch_reads;
+static volatile uint32_t ct_prefetch_pages;
+static volatile uint32_t ct_cowfaults;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
 int
@@ -55,26 +67,71 @@ vm_printstats(int nargs, char **args)
 {
 	(void)nargs;
 	(void)args;
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, fl, mn, mj, de, we, te, cw, pr, pp, cf;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
+	fl = ct_fileloads;
 	mn = ct_minfaults;
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cw = ct_cluster_writes;
+	pr = ct_prefetch_reads;
+	pp = ct_prefetch_pages;
+	cf = ct_cowfaults;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
 
 	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu pages loaded from files\n", (unsigned long) fl);
+	kprintf("vm: %lu copy-on-write faults\n", (unsigned long) cf);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu swap writes\n", (unsigned long) cw);
+	kprintf("vm: %lu prefetch reads (%lu pages)\n",
+		(unsigned long) pr, (unsigned long) pp);
 	vm_printmdstats();
 	return 0;
 }
 
+/*
+ * Constructor and destructor for lpage_cache.
+ */
+static
+int
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+	return 0;
+}
+
+static
+void
+lpage_dtor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_cleanup(&lp->lp_spinlock);
+}
+
+/*
+ * lpage_bootstrap: set up the lpage cache.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_cache = kmem_cache_create("lpage", sizeof(struct lpage),
+					lpage_ctor, lpage_dtor);
+	if (lpage_cache == NULL) {
+		panic("lpage_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a logical page object.
  * Synchronization: none.
@@ -84,36 +141,55 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
+	lp->lp_refcount = 1;
+	lp->lp_modified = false;
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
- * pages involved.
+ * lpage_destroy: drops a reference to a logical page. If it was the
+ * last one, deallocates the page and releases any RAM or swap pages
+ * involved. Otherwise just gives back the swap reservation that the
+ * reference was holding, if any: pages with no swap page (read-only
+ * file pages) never hold one.
  *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
- * together.
+ * together. Once the count reaches zero nobody else can find the
+ * page.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * We assume that address spaces are not shared between threads.
  */
 void 					
 lpage_destroy(struct lpage *lp)
 {
 	paddr_t pa;
+	off_t swa;
+	unsigned refs;
 
 	KASSERT(lp != NULL);
 
+	lpage_lock(lp);
+	KASSERT(lp->lp_refcount > 0);
+	refs = --lp->lp_refcount;
+	swa = lp->lp_swapaddr;
+	lpage_unlock(lp);
+
+	if (refs > 0) {
+		if (swa != INVALID_SWAPADDR) {
+			swap_unreserve(1);
+		}
+		return;
+	}
+
 	lpage_lock_and_pin(lp);
 
 	pa = lp->lp_paddr & PAGE_FRAME;
@@ -134,8 +210,7 @@ lpage_destroy(struct lpage *lp)
 		swap_free(lp->lp_swapaddr);
 	}
 
-	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(lpage_cache, lp);
 }
 
 
@@ -276,6 +351,82 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 	return 0;
 }
 
+/*
+ * lpage_pagein: bring a non-resident lpage into memory.
+ *
+ * Called with the lpage locked (as left by lpage_lock_and_pin when
+ * the page isn't resident). Returns with it locked again, resident,
+ * and its physical page pinned; or on error, unlocked.
+ *
+ * A page with no swap page is a read-only file page and is read
+ * from VMO's file; VA says which page it is. Otherwise VMO may be
+ * NULL.
+ *
+ * The lpage is unlocked while we get memory and do the I/O. If the
+ * page is shared copy-on-write, another owner may load it meanwhile
+ * (or load it and evict it again to a new swap address). In that
+ * case throw away what we read and take theirs, or start over.
+ */
+static
+int
+lpage_pagein(struct lpage *lp, struct vm_object *vmo, vaddr_t va,
+	     paddr_t *paret)
+{
+	paddr_t pa;
+	off_t swa;
+	int result;
+
+	while (1) {
+		KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+
+		swa = lp->lp_swapaddr;
+		lpage_unlock(lp);
+
+		/* Allocate a page and pin it. */
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			return ENOMEM;
+		}
+		KASSERT(coremap_pageispinned(pa));
+
+		/* Read the data into the page. */
+		if (swa == INVALID_SWAPADDR) {
+			KASSERT(vmo != NULL && vmo->vmo_readonly);
+			result = vm_object_readpage(vmo, va, pa);
+			if (result) {
+				coremap_free(pa, false /* iskern */);
+				coremap_unpin(pa);
+				return result;
+			}
+		}
+		else {
+			swap_pagein(pa, swa);
+		}
+
+		lpage_lock(lp);
+		if ((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR &&
+		    lp->lp_swapaddr == swa) {
+			/* Fresh from disk, so clean. */
+			lp->lp_paddr = pa;
+			*paret = pa;
+			return 0;
+		}
+
+		/* Another owner of the page got there first. */
+		lpage_unlock(lp);
+		coremap_free(pa, false /* iskern */);
+		coremap_unpin(pa);
+
+		lpage_lock_and_pin(lp);
+		pa = lp->lp_paddr & PAGE_FRAME;
+		if (pa != INVALID_PADDR) {
+			*paret = pa;
+			return 0;
+		}
+	}
+}
+
 /*
  * lpage_copy: create a new lpage and copy data from another lpage.
  *
@@ -284,17 +435,14 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  *
  *      1. Create newlp.
  *      2. Materialize a page for newlp, so it's locked and pinned.
+ *         Nobody else knows about newlp, so unlock it right away;
+ *         we may need to sleep below.
  *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
- *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
- *      8. Unpin the physical pages.
+ *      4. If oldlp wasn't present, page it in (lpage_pagein), which
+ *         leaves it locked and pinned.
+ *      5. Copy.
+ *      6. Unlock oldlp first, so we can enter the coremap.
+ *      7. Unpin the physical pages.
  *      
  */
 int
@@ -302,7 +450,6 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
-	off_t swa;
 	int result;
 
 	result = lpage_materialize(&newlp, &newpa);
@@ -310,48 +457,31 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 		return result;
 	}
 	KASSERT(coremap_pageispinned(newpa));
+	KASSERT(LP_ISDIRTY(newlp));
+	lpage_unlock(newlp);
 
 	/* Pin the physical page and lock the lpage. */
 	lpage_lock_and_pin(oldlp);
 	oldpa = oldlp->lp_paddr & PAGE_FRAME;
 
-	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
-	 */
 	if (oldpa == INVALID_PADDR) {
-		/*
-		 * XXX this is mostly copied from lpage_fault
-		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
+		/* Only writable pages get copied, and they have swap. */
+		KASSERT(oldlp->lp_swapaddr != INVALID_SWAPADDR);
+		result = lpage_pagein(oldlp, NULL, 0, &oldpa);
+		if (result) {
+			coremap_unpin(newpa);
 			lpage_destroy(newlp);
-			return ENOMEM;
+			return result;
 		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
 	}
 
 	KASSERT(coremap_pageispinned(oldpa));
 
 	coremap_copy_page(oldpa, newpa);
-
-	KASSERT(LP_ISDIRTY(newlp));
+	/* Nobody else knows about newlp yet. */
+	newlp->lp_modified = oldlp->lp_modified;
 
 	lpage_unlock(oldlp);
-	lpage_unlock(newlp);
 
 	coremap_unpin(newpa);
 	coremap_unpin(oldpa);
@@ -360,6 +490,93 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_share: add a reference to an lpage, for a copy-on-write fork.
+ * The new reference holds one of the caller's swap reservations (see
+ * vm_object_copy). The page may be mapped writable right now; make
+ * that mapping read-only so the next write faults and gets a copy.
+ *
+ * Synchronization: lock and pin, so the page can't be evicted while
+ * we fiddle with its mapping.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	paddr_t pa;
+
+	lpage_lock_and_pin(lp);
+	lp->lp_refcount++;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		mmu_protect_page(pa);
+		coremap_unpin(pa);
+	}
+}
+
+/*
+ * lpage_isshared: returns true if more than one vm_object refers to
+ * the lpage. The answer can change from true to false at any time,
+ * as other owners let go, but not the other way unless the caller
+ * shares the page itself.
+ */
+bool
+lpage_isshared(struct lpage *lp)
+{
+	bool ret;
+
+	lpage_lock(lp);
+	ret = lp->lp_refcount > 1;
+	lpage_unlock(lp);
+	return ret;
+}
+
+/*
+ * lpage_unshare: break copy-on-write sharing. Makes a private copy of
+ * LP for the caller, whose mapping of it is at VA in AS, and drops the
+ * caller's reference to LP.
+ *
+ * The copy needs a swap page of its own. Reserve one for it; dropping
+ * the old reference gives back the reservation that reference held
+ * (or, if everyone else let go meanwhile, frees the old swap page),
+ * so the totals come out even.
+ */
+int
+lpage_unshare(struct lpage *lp, struct addrspace *as, vaddr_t va,
+	      struct lpage **lpret)
+{
+	struct lpage *newlp;
+	int result;
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	result = lpage_copy(lp, &newlp);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	/*
+	 * Our read-only mapping of the old page may still be in a TLB,
+	 * possibly on a CPU we ran on before; it must not outlive our
+	 * reference. The other owners' mappings stay.
+	 */
+	mmu_unmap(as, va);
+
+	lpage_destroy(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_cowfaults++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = newlp;
+	return 0;
+}
+
 /*
  * lpage_zerofill: create a new lpage and arrange for it to be cleared
  * to all zeros. The current implementation causes the lpage to be
@@ -402,39 +619,287 @@ lpage_zerofill(struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_fileload: create a new lpage for the page at VA in the
+ * file-backed vm_object VMO, and read its contents from the file.
+ *
+ * A page of a writable object is materialized like a zerofill page:
+ * it gets swap and starts out dirty, since the file is not where it
+ * goes when evicted. A page of a read-only object gets no swap and
+ * starts out clean, so eviction just drops it and lpage_pagein reads
+ * it from the file again.
+ *
+ * Synchronization: as for lpage_zerofill. Nobody else knows about
+ * the new lpage, so it need not be locked during the read.
+ */
+int
+lpage_fileload(struct vm_object *vmo, vaddr_t va, struct lpage **lpret)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+
+	if (vmo->vmo_readonly) {
+		lp = lpage_create();
+		if (lp == NULL) {
+			return ENOMEM;
+		}
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			lpage_destroy(lp);
+			return ENOMEM;
+		}
+		lpage_lock(lp);
+		lp->lp_paddr = pa;
+	}
+	else {
+		result = lpage_materialize(&lp, &pa);
+		if (result) {
+			return result;
+		}
+	}
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(coremap_pageispinned(pa));
+
+	/* Don't actually need the lpage locked. */
+	lpage_unlock(lp);
+
+	result = vm_object_readpage(vmo, va, pa);
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+
+	if (result) {
+		lpage_destroy(lp);
+		return result;
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_fileloads++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * lpage_sharedload: create a new lpage for page INDEX of the file
+ * behind the shared pages VNP, and read it in. The caller must have
+ * reserved a swap page for it. Otherwise like lpage_fileload for a
+ * writable object: the page has swap and starts out dirty, but not
+ * modified.
+ */
+int
+lpage_sharedload(struct vnpages *vnp, unsigned index, struct lpage **lpret)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	int result;
+
+	result = lpage_materialize(&lp, &pa);
+	if (result) {
+		return result;
+	}
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(coremap_pageispinned(pa));
+
+	/* Nobody else knows about it yet. */
+	lpage_unlock(lp);
+
+	result = vnpages_readpage(vnp, index, pa);
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+
+	if (result) {
+		lpage_destroy(lp);
+		return result;
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_fileloads++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * lpage_sharedsync: if LP, page INDEX of the shared pages VNP, has
+ * been written since it was loaded, write it back to the file, paging
+ * it in from swap first if need be.
+ *
+ * The page may be mapped, writable, in any number of address spaces.
+ * Take away write access first and clear lp_modified, so any store
+ * that misses the write faults again and marks the page modified for
+ * next time.
+ *
+ * Synchronization: lock and pin the page to find it, then unlock it
+ * for the write, leaving it pinned so it stays put.
+ */
+int
+lpage_sharedsync(struct lpage *lp, struct vnpages *vnp, unsigned index)
+{
+	paddr_t pa;
+	int result;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (!lp->lp_modified) {
+		lpage_unlock(lp);
+		if (pa != INVALID_PADDR) {
+			coremap_unpin(pa);
+		}
+		return 0;
+	}
+	if (pa == INVALID_PADDR) {
+		/* Shared file pages always have swap. */
+		result = lpage_pagein(lp, NULL, 0, &pa);
+		if (result) {
+			return result;
+		}
+	}
+	lp->lp_modified = false;
+	lpage_unlock(lp);
+
+	mmu_protect_page(pa);
+
+	result = vnpages_writepage(vnp, index, pa);
+	if (result) {
+		lpage_lock(lp);
+		lp->lp_modified = true;
+		lpage_unlock(lp);
+	}
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+	return result;
+}
+
+/*
+ * lpage_sharedreload: read LP, page INDEX of the shared pages VNP,
+ * from the file again, after write() has changed it underneath. The
+ * copy in swap, if any, is stale after that, so the page is dirty.
+ *
+ * Synchronization: as for lpage_sharedsync.
+ */
+int
+lpage_sharedreload(struct lpage *lp, struct vnpages *vnp, unsigned index)
+{
+	paddr_t pa;
+	int result;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR) {
+		result = lpage_pagein(lp, NULL, 0, &pa);
+		if (result) {
+			return result;
+		}
+	}
+	LP_SET(lp, LPF_DIRTY);
+	lp->lp_modified = false;
+	lpage_unlock(lp);
+
+	/* As in lpage_sharedsync, stores after this mark it modified. */
+	mmu_protect_page(pa);
+
+	result = vnpages_readpage(vnp, index, pa);
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+	return result;
+}
+
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
- * not resident, get a physical page from coremap and swap it in.
+ * not resident, get a physical page from coremap and swap it in (or
+ * read it from the file, for a read-only page of VMO).
  * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ * A clean page is mapped read-only, even for a read fault on a
+ * writable region, so that the first write traps (as a readonly
+ * fault) and we can mark the page dirty. A page that's already
+ * dirty is mapped writable straight away, unless it's shared
+ * copy-on-write; the caller must unshare it before a write. Pages of
+ * shared file mappings likewise stay read-only until they're marked
+ * modified, so lpage_sharedsync knows which ones to write back, and
+ * are never writable through a read-only mapping.
  *
  * Synchronization: Lock the lpage while checking if it's in memory. 
- * If it's not, unlock the page while allocting space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
+ * If it's not, lpage_pagein unlocks it while allocating space and
+ * loading the page in.
  *
  * After it has been loaded, the page must be pinned so that it is not
  * evicted while changes are made to the TLB. It can be unpinned as soon
  * as the TLB is updated. 
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_fault(struct lpage *lp, struct vm_object *vmo, struct addrspace *as,
+	    int faulttype, vaddr_t va)
 {
-	(void)lp;	// suppress compiler warning until code gets written
-	(void)as;	// suppress compiler warning until code gets written
-	(void)faulttype;// suppress compiler warning until code gets written
-	(void)va;	// suppress compiler warning until code gets written
-	return EUNIMP;	// suppress compiler warning until code gets written
+	paddr_t pa;
+	int writable;
+	int result;
+
+	/* Pin the physical page and lock the lpage. */
+	lpage_lock_and_pin(lp);
+
+	/* Get the physical address */
+	pa = lp->lp_paddr & PAGE_FRAME;
+
+	/* If the page is not in RAM, load into RAM. */
+	if (pa == INVALID_PADDR) {
+		result = lpage_pagein(lp, vmo, va, &pa);
+		if (result) {
+			return result;
+		}
+
+		spinlock_acquire(&stats_spinlock);
+		ct_majfaults++;
+		spinlock_release(&stats_spinlock);
+	}
+	else {
+		spinlock_acquire(&stats_spinlock);
+		ct_minfaults++;
+		spinlock_release(&stats_spinlock);
+	}
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		writable = LP_ISDIRTY(lp) != 0 && lp->lp_refcount == 1;
+		if (vmo->vmo_vnpages != NULL &&
+		    (!lp->lp_modified || vmo->vmo_readonly)) {
+			writable = 0;
+		}
+		break;
+	    case VM_FAULT_WRITE:
+	    case VM_FAULT_READONLY:
+		KASSERT(lp->lp_refcount == 1);
+		LP_SET(lp, LPF_DIRTY);
+		lp->lp_modified = true;
+		writable = 1;
+		break;
+	    default:
+		panic("lpage_fault: invalid fault type %d\n", faulttype);
+	}
+
+	/* Unlock the lpage before entering the coremap. */
+	lpage_unlock(lp);
+
+	/* This also unpins the page. */
+	mmu_map(as, va, pa, writable);
+
+	return 0;
 }
 
 /*
  * lpage_evict: Evict an lpage from physical memory.
  *
  * Synchronization: lock the lpage while accessing it. We come here
- * from the coremap and should have the global paging lock and should 
- * have pinned the physical page (see coremap.c:do_evict()). 
+ * from the coremap, which has pinned the physical page (see
+ * coremap.c:do_evict_start()). 
  * This is why we must not hold lpage locks while entering the coremap code.
  *
  * Similar to lpage_fault, the lpage lock should not be held while performing
@@ -443,5 +908,183 @@ lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
 void
 lpage_evict(struct lpage *lp)
 {
-	(void)lp;	// suppress compiler warning until code gets written
+	lpage_evict_cluster(&lp, 1);
+}
+
+/*
+ * lpage_evict_cluster: Evict several lpages from physical memory,
+ * writing the dirty ones to swap in as few disk requests as possible.
+ *
+ * If there's room in swap, the dirty pages are moved to a run of
+ * consecutive swap slots first (giving up their old slots) so they
+ * can all be written at once. Otherwise each keeps its slot, the
+ * pages whose slots happen to be adjacent are written together, and
+ * the writes for the separate runs are all queued on the disk at once.
+ *
+ * Synchronization: as for lpage_evict, for each page.
+ */
+void
+lpage_evict_cluster(struct lpage **lps, unsigned n)
+{
+	struct lpage *dirty[SWAP_MAXCLUSTER];
+	paddr_t pas[SWAP_MAXCLUSTER];
+	off_t swas[SWAP_MAXCLUSTER];
+	struct lpage *lp;
+	paddr_t pa;
+	off_t swa, base;
+	unsigned i, j, ndirty, ndiscard, run;
+
+	KASSERT(n > 0 && n <= SWAP_MAXCLUSTER);
+
+	/* Sort the pages out. Clean ones can go right away. */
+	ndirty = ndiscard = 0;
+	for (i=0; i<n; i++) {
+		lp = lps[i];
+		KASSERT(lp != NULL);
+
+		lpage_lock(lp);
+
+		pa = lp->lp_paddr & PAGE_FRAME;
+		swa = lp->lp_swapaddr;
+
+		KASSERT(pa != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pa));
+
+		if (LP_ISDIRTY(lp)) {
+			/* Only read-only file pages lack swap. */
+			KASSERT(swa != INVALID_SWAPADDR);
+
+			/* Keep sorted by swap address, for the fallback. */
+			for (j = ndirty; j > 0 && swas[j-1] > swa; j--) {
+				dirty[j] = dirty[j-1];
+				pas[j] = pas[j-1];
+				swas[j] = swas[j-1];
+			}
+			dirty[j] = lp;
+			pas[j] = pa;
+			swas[j] = swa;
+			ndirty++;
+		}
+		else {
+			lp->lp_paddr = INVALID_PADDR;
+			ndiscard++;
+		}
+
+		lpage_unlock(lp);
+	}
+
+	/*
+	 * Write the dirty pages. The pages are pinned and out of the
+	 * TLB, so nobody can touch them or their lpages' swap
+	 * addresses until we're done.
+	 */
+	base = (ndirty > 1) ? swap_alloc_cluster(ndirty) : INVALID_SWAPADDR;
+	if (base != INVALID_SWAPADDR) {
+		swap_pageout_cluster(pas, ndirty, base);
+		for (i=0; i<ndirty; i++) {
+			swap_free(swas[i]);
+			swas[i] = base + i*PAGE_SIZE;
+		}
+		run = 1;
+	}
+	else if (ndirty > 0) {
+		run = swap_pageout_runs(pas, swas, ndirty);
+	}
+	else {
+		run = 0;
+	}
+
+	for (i=0; i<ndirty; i++) {
+		lp = dirty[i];
+		lpage_lock(lp);
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == pas[i]);
+		lp->lp_swapaddr = swas[i];
+		lp->lp_paddr = INVALID_PADDR;
+		lpage_unlock(lp);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_discard_evictions += ndiscard;
+	ct_write_evictions += ndirty;
+	ct_cluster_writes += run;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_prefetch: Read swapped-out lpages into memory ahead of need.
+ *
+ * Takes the leading run of LPS that are not resident and sit in
+ * consecutive swap slots, gets spare physical pages for them (without
+ * evicting anything), and reads them all in one request. The pages
+ * are not mapped; the first touch of each takes a minor fault.
+ *
+ * Synchronization: as for lpage_fault, lock each lpage only while
+ * looking at it. Pages shared copy-on-write might get loaded by
+ * another owner while we're reading; if so, keep theirs.
+ */
+void
+lpage_prefetch(struct lpage **lps, unsigned n)
+{
+	paddr_t pas[SWAP_MAXCLUSTER];
+	struct lpage *lp;
+	paddr_t pa;
+	off_t swa, base;
+	unsigned i, count;
+
+	KASSERT(n <= SWAP_MAXCLUSTER);
+
+	base = INVALID_SWAPADDR;
+	for (count = 0; count < n; count++) {
+		lp = lps[count];
+		lpage_lock(lp);
+		pa = lp->lp_paddr & PAGE_FRAME;
+		swa = lp->lp_swapaddr;
+		lpage_unlock(lp);
+
+		if (pa != INVALID_PADDR || swa == INVALID_SWAPADDR) {
+			break;
+		}
+		if (count == 0) {
+			base = swa;
+		}
+		else if (swa != base + count*PAGE_SIZE) {
+			break;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		pas[i] = coremap_allocuser_spare(lps[i]);
+		if (pas[i] == INVALID_PADDR) {
+			break;
+		}
+	}
+	count = i;
+
+	if (count == 0) {
+		return;
+	}
+
+	swap_pagein_cluster(pas, count, base);
+
+	for (i = 0; i < count; i++) {
+		lp = lps[i];
+		lpage_lock(lp);
+		if ((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR ||
+		    lp->lp_swapaddr != base + i*PAGE_SIZE) {
+			/* Another owner of a shared page beat us to it. */
+			lpage_unlock(lp);
+			coremap_free(pas[i], false /* iskern */);
+			coremap_unpin(pas[i]);
+			continue;
+		}
+		/* Fresh from swap, so clean. */
+		lp->lp_paddr = pas[i];
+		lpage_unlock(lp);
+		coremap_unpin(pas[i]);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_prefetch_reads++;
+	ct_prefetch_pages += count;
+	spinlock_release(&stats_spinlock);
 }
@@ -34,7 +34,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <bitmap.h>
+#include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <mainbus.h>
@@ -44,6 +46,7 @@
 #include <machine/coremap.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <device.h>
 
 /*
  * swap.c - swapfile management and operations.
@@ -67,20 +70,15 @@ static unsigned long swap_free_pages;
 static unsigned long swap_reserved_pages;
 
 static struct vnode *swapstore;	// swap file
+static struct device *swapdev;	// device under swapstore, if any
 
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
- *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * For waiting on requests queued with d_submit: swap_iolock protects
+ * the pending counts of swap_pageout_runs callers, who wait on
+ * swap_iochan for theirs to reach zero.
  */
-
-struct lock *global_paging_lock;
+static struct spinlock swap_iolock;
+static struct wchan *swap_iochan;
 
 
 /*
@@ -127,6 +125,13 @@ swap_bootstrap(void)
 		panic("swap: Unable to continue.\n");
 	}
 
+	swapdev = dev_vnode_device(swapstore);
+	spinlock_init(&swap_iolock);
+	swap_iochan = wchan_create("swapio");
+	if (swap_iochan == NULL) {
+		panic("swap: No memory for swap wait channel\n");
+	}
+
 	kprintf("swap: swapping to %s (%lu bytes; %lu pages)\n", swapfilename,
 		(unsigned long) st.st_size, 
 		(unsigned long) st.st_size / PAGE_SIZE);
@@ -266,39 +271,69 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_alloc_cluster: allocates a run of NPAGES consecutive pages in
+ * the swapfile and returns the address of the first. Used by pageout
+ * to gather pages being evicted into a single disk write.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Unlike swap_alloc, the pages come out of the unreserved free pool;
+ * the caller is moving pages that already have swap, and is expected
+ * to free their old pages afterwards. Returns INVALID_SWAPADDR if no
+ * such run is available.
+ *
+ * Synchronization: uses swaplock.
  */
-static
-void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+off_t
+swap_alloc_cluster(unsigned npages)
 {
-	struct iovec iov;
-	struct uio u;
-	vaddr_t va;
-	int result;
+	uint32_t index, i;
+	unsigned run;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
+	KASSERT(npages > 0);
 
-	KASSERT(pa != INVALID_PADDR);
-	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
+	lock_acquire(swaplock);
+
+	KASSERT(swap_free_pages <= swap_total_pages);
+	KASSERT(swap_reserved_pages <= swap_free_pages);
 
-	va = coremap_map_swap_page(pa);
+	if (swap_free_pages - swap_reserved_pages < npages) {
+		lock_release(swaplock);
+		return INVALID_SWAPADDR;
+	}
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
-	if (rw==UIO_READ) {
-		result = VOP_READ(swapstore, &u);
+	run = 0;
+	for (index = 0; index < swap_total_pages; index++) {
+		if (bitmap_isset(swapmap, index)) {
+			run = 0;
+			continue;
+		}
+		if (++run == npages) {
+			break;
+		}
 	}
-	else {
-		result = VOP_WRITE(swapstore, &u);
+	if (run < npages) {
+		lock_release(swaplock);
+		return INVALID_SWAPADDR;
+	}
+
+	index = index + 1 - npages;
+	for (i = index; i < index + npages; i++) {
+		bitmap_mark(swapmap, i);
 	}
+	swap_free_pages -= npages;
 
-	coremap_unmap_swap_page(va, pa);
+	lock_release(swaplock);
 
+	return (off_t)index * PAGE_SIZE;
+}
+
+/*
+ * swap_ioerror: Report a failed swap I/O. There's nothing sensible
+ * to do about one, so panic.
+ */
+static
+void
+swap_ioerror(int result, off_t swapaddr)
+{
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
 		      (long)swapaddr);
@@ -307,12 +342,69 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 		panic("swap: EINVAL from swapfile (offset %ld)\n",
 		      (long)swapaddr);
 	}
-	else if (result) {
+	else {
 		panic("swap: Error %d from swapfile (offset %ld)\n",
 		      result, (long)swapaddr);
 	}
 }
 
+/*
+ * swap_io: Does one swap I/O, of NPAGES physical pages to or from
+ * consecutive pages of the swapfile. Panics on failure.
+ *
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
+ * Any number of swap I/Os can be in flight at once; the disk driver
+ * queues them.
+ */
+static
+void
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr,
+	enum uio_rw rw)
+{
+	struct iovec iov[SWAP_MAXCLUSTER];
+	vaddr_t va[SWAP_MAXCLUSTER];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(npages > 0 && npages <= SWAP_MAXCLUSTER);
+	KASSERT(swapaddr % PAGE_SIZE == 0);
+
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+
+		va[i] = coremap_map_swap_page(pas[i]);
+		iov[i].iov_kbase = (void *)va[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	if (rw==UIO_READ) {
+		result = VOP_READ(swapstore, &u);
+	}
+	else {
+		result = VOP_WRITE(swapstore, &u);
+	}
+
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page(va[i], pas[i]);
+	}
+
+	if (result) {
+		swap_ioerror(result, swapaddr);
+	}
+}
+
 /*
  * swap_pagein: load one page from swap into physical memory.
  * Synchronization: none here. See swap_io().
@@ -320,10 +412,21 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(&pa, 1, swapaddr, UIO_READ);
 }
 
 
+/*
+ * swap_pagein_cluster: load several pages from consecutive pages of
+ * swap, starting at the requested address, in one disk request.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_READ);
+}
+
 /* 
  * swap_pageout: write one page from physical memory into swap.
  * Synchronization: none here. See swap_io().
@@ -331,5 +434,153 @@ swap_pagein(paddr_t pa, off_t swapaddr)
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(&pa, 1, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_pageout_cluster: write several pages from physical memory into
+ * consecutive pages of swap, starting at the requested address, in
+ * one disk request.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pageout_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_runlength: how many of the N sorted swap addresses starting
+ * at SWAS are consecutive pages of swap.
+ */
+static
+unsigned
+swap_runlength(const off_t *swas, unsigned n)
+{
+	unsigned j;
+
+	for (j=1; j<n; j++) {
+		if (swas[j] != swas[0] + j*PAGE_SIZE) {
+			break;
+		}
+	}
+	return j;
+}
+
+/*
+ * Completion routine for the requests of swap_pageout_runs. Called
+ * in interrupt context.
+ */
+static
+void
+swap_iodone(struct blkreq *req)
+{
+	unsigned *pending = req->br_data;
+
+	spinlock_acquire(&swap_iolock);
+	KASSERT(*pending > 0);
+	(*pending)--;
+	if (*pending == 0) {
+		wchan_wakeall(swap_iochan);
+	}
+	spinlock_release(&swap_iolock);
+}
+
+/*
+ * swap_pageout_runs: write N physical pages to the swap addresses
+ * SWAS, which must be in increasing order but need not be
+ * consecutive. Each run of consecutive addresses is one disk
+ * request. Returns the number of requests.
+ *
+ * If the swap device can queue requests, they are all handed to it
+ * before waiting for any, so the disk can go from one straight to the
+ * next (in whatever order suits the head) instead of sitting idle
+ * while this thread wakes up and starts the next. Otherwise they are
+ * done one at a time with swap_io.
+ *
+ * Synchronization: as for swap_io.
+ */
+unsigned
+swap_pageout_runs(const paddr_t *pas, const off_t *swas, unsigned n)
+{
+	struct blkreq reqs[SWAP_MAXCLUSTER];
+	struct uio uios[SWAP_MAXCLUSTER];
+	struct iovec iov[SWAP_MAXCLUSTER];
+	vaddr_t va[SWAP_MAXCLUSTER];
+	unsigned pending, nreqs, i, j, k;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_MAXCLUSTER);
+
+	if (swapdev == NULL || swapdev->d_submit == NULL) {
+		nreqs = 0;
+		for (i=0; i<n; i += j) {
+			j = swap_runlength(&swas[i], n - i);
+			swap_io(&pas[i], j, swas[i], UIO_WRITE);
+			nreqs++;
+		}
+		return nreqs;
+	}
+
+	for (i=0; i<n; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(swas[i] % PAGE_SIZE == 0);
+		KASSERT(i == 0 || swas[i] > swas[i-1]);
+		KASSERT(bitmap_isset(swapmap, swas[i] / PAGE_SIZE));
+
+		va[i] = coremap_map_swap_page(pas[i]);
+		iov[i].iov_kbase = (void *)va[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	nreqs = 0;
+	for (i=0; i<n; i += j) {
+		j = swap_runlength(&swas[i], n - i);
+
+		uios[nreqs].uio_iov = &iov[i];
+		uios[nreqs].uio_iovcnt = j;
+		uios[nreqs].uio_offset = swas[i];
+		uios[nreqs].uio_resid = j * PAGE_SIZE;
+		uios[nreqs].uio_segflg = UIO_SYSSPACE;
+		uios[nreqs].uio_rw = UIO_WRITE;
+		uios[nreqs].uio_space = NULL;
+
+		reqs[nreqs].br_uio = &uios[nreqs];
+		reqs[nreqs].br_done = swap_iodone;
+		reqs[nreqs].br_data = &pending;
+		nreqs++;
+	}
+
+	/* Count them all first, so an early finisher can't hit zero. */
+	pending = nreqs;
+	for (i=0; i<nreqs; i++) {
+		result = swapdev->d_submit(swapdev, &reqs[i]);
+		if (result) {
+			swap_ioerror(result, uios[i].uio_offset);
+		}
+	}
+
+	spinlock_acquire(&swap_iolock);
+	while (pending > 0) {
+		wchan_lock(swap_iochan);
+		spinlock_release(&swap_iolock);
+		wchan_sleep(swap_iochan);
+		spinlock_acquire(&swap_iolock);
+	}
+	spinlock_release(&swap_iolock);
+
+	for (i=0; i<n; i++) {
+		coremap_unmap_swap_page(va[i], pas[i]);
+	}
+
+	/* The uios have been used up, so find each run's start again. */
+	for (i=0, k=0; k<nreqs; i += j, k++) {
+		j = swap_runlength(&swas[i], n - i);
+		if (reqs[k].br_result) {
+			swap_ioerror(reqs[k].br_result, swas[i]);
+		}
+	}
+
+	return nreqs;
 }
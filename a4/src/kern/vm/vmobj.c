@@ -31,6 +31,8 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -44,43 +46,59 @@
 DEFARRAY_BYTYPE(lpage_array, struct lpage, /*noinline*/);
 
 /*
- * vm_object_create: Allocate a new vm_object with nothing in it.
- * Returns: new vm_object on success, NULL on error.
+ * vm_object_alloc: common code for vm_object_create and
+ * vm_object_create_file. Reserves swap for the pages only if
+ * RESERVE is set.
  */
+static
 struct vm_object *
-vm_object_create(size_t npages)
+vm_object_alloc(size_t npages, bool reserve)
 {
 	struct vm_object *vmo;
+	size_t nreserve;
 	unsigned i;
 	int result;
 
-	result = swap_reserve(npages);
+	nreserve = reserve ? npages : 0;
+
+	result = swap_reserve(nreserve);
 	if (result != 0) {
 		return NULL;
 	}
 
 	vmo = kmalloc(sizeof(struct vm_object));
 	if (vmo == NULL) {
-		swap_unreserve(npages);
+		swap_unreserve(nreserve);
 		return NULL;
 	}
 
 	vmo->vmo_lpages = lpage_array_create();
 	if (vmo->vmo_lpages == NULL) {
 		kfree(vmo);
-		swap_unreserve(npages);
+		swap_unreserve(nreserve);
 		return NULL;
 	}
 
 	vmo->vmo_base = 0xdeafbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
+	vmo->vmo_nextfault = 0;
+	vmo->vmo_seqfaults = 0;
+	spinlock_init(&vmo->vmo_faultlock);
+	vmo->vmo_vnode = NULL;
+	vmo->vmo_fileoffset = 0;
+	vmo->vmo_filevaddr = 0;
+	vmo->vmo_filesize = 0;
+	vmo->vmo_readonly = !reserve;
+	vmo->vmo_mapped = false;
+	vmo->vmo_vnpages = NULL;
 
 	/* add the requested number of zerofilled pages */
 	result = lpage_array_setsize(vmo->vmo_lpages, npages);
 	if (result) {
+		spinlock_cleanup(&vmo->vmo_faultlock);
 		lpage_array_destroy(vmo->vmo_lpages);
 		kfree(vmo);
-		swap_unreserve(npages);
+		swap_unreserve(nreserve);
 		return NULL;
 	}
 
@@ -91,10 +109,91 @@ vm_object_create(size_t npages)
 	return vmo;
 }
 
+/*
+ * vm_object_create: Allocate a new vm_object with nothing in it.
+ * Returns: new vm_object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_create(size_t npages)
+{
+	return vm_object_alloc(npages, true);
+}
+
+/*
+ * vm_object_create_file: Allocate a new vm_object whose pages come
+ * from FILESIZE bytes of vnode V at offset OFFSET, placed at virtual
+ * address FILEVADDR, with zeros around them. Nothing is read yet;
+ * see lpage_fileload.
+ *
+ * A READONLY object reserves no swap; its pages can always be read
+ * from the file again.
+ *
+ * Returns: new vm_object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_create_file(size_t npages, struct vnode *v, off_t offset,
+		      vaddr_t filevaddr, size_t filesize, bool readonly)
+{
+	struct vm_object *vmo;
+
+	KASSERT(v != NULL);
+
+	vmo = vm_object_alloc(npages, !readonly);
+	if (vmo == NULL) {
+		return NULL;
+	}
+
+	VOP_INCREF(v);
+	vmo->vmo_vnode = v;
+	vmo->vmo_fileoffset = offset;
+	vmo->vmo_filevaddr = filevaddr;
+	vmo->vmo_filesize = filesize;
+
+	return vmo;
+}
+
+/*
+ * vm_object_create_shared: Allocate a new vm_object for a MAP_SHARED
+ * mapping of the file whose shared pages are VNP, starting at file
+ * offset OFFSET (a multiple of the page size). Takes a reference to
+ * VNP. The pages are the table's, so no swap is reserved here; if
+ * READONLY, write faults are refused.
+ *
+ * Returns: new vm_object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_create_shared(size_t npages, struct vnpages *vnp, off_t offset,
+			bool readonly)
+{
+	struct vm_object *vmo;
+
+	KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+	vmo = vm_object_alloc(npages, false);
+	if (vmo == NULL) {
+		return NULL;
+	}
+
+	vnpages_incref(vnp);
+	vmo->vmo_vnpages = vnp;
+	vmo->vmo_fileoffset = offset;
+	vmo->vmo_readonly = readonly;
+
+	return vmo;
+}
+
 /*
  * vm_object_copy: clone a vm_object.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * The pages aren't copied; the new object shares them copy-on-write
+ * and the first write from either side makes a private copy (see
+ * as_fault). The swap reserved for the new object's pages stays
+ * reserved, held by the shared references, to pay for those copies.
+ *
+ * The copy of a shared file mapping is another mapping of the same
+ * shared pages, so the child sees the parent's stores and vice versa.
+ *
+ * Synchronization: None; lpage_share does the hard stuff.
  */
 int
 vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
@@ -104,15 +203,34 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 
 	struct lpage *newlp, *lp;
 	unsigned j;
-	int result;
 
-	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
+	(void)newas;
+
+	if (vmo->vmo_vnpages != NULL) {
+		newvmo = vm_object_create_shared(
+					lpage_array_num(vmo->vmo_lpages),
+					vmo->vmo_vnpages,
+					vmo->vmo_fileoffset,
+					vmo->vmo_readonly);
+	}
+	else if (vmo->vmo_vnode != NULL) {
+		newvmo = vm_object_create_file(lpage_array_num(vmo->vmo_lpages),
+					       vmo->vmo_vnode,
+					       vmo->vmo_fileoffset,
+					       vmo->vmo_filevaddr,
+					       vmo->vmo_filesize,
+					       vmo->vmo_readonly);
+	}
+	else {
+		newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
+	}
 	if (newvmo == NULL) {
 		return ENOMEM;
 	}
 
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
+	newvmo->vmo_mapped = vmo->vmo_mapped;
 
 	for (j = 0; j < lpage_array_num(vmo->vmo_lpages); j++) {
 		lp = lpage_array_get(vmo->vmo_lpages, j);
@@ -126,23 +244,22 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
-		if (result) {
-			goto fail;
+		if (vmo->vmo_vnpages == NULL) {
+			lpage_share(lp);
 		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+		lpage_array_set(newvmo->vmo_lpages, j, lp);
 	}
 
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
  * vm_object_setsize: change the size of a vm_object.
+ *
+ * Pages dropped from a shared file mapping are only unmapped; they
+ * belong to the vnpages table, which writes them back when the last
+ * mapping of them is gone.
  */
 int
 vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
@@ -161,10 +278,20 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 				KASSERT(as != NULL);
 				/* remove any tlb entry for this mapping */
 				mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
-				lpage_destroy(lp);
+				if (vmo->vmo_vnpages == NULL) {
+					lpage_destroy(lp);
+				}
 			}
 			else {
-				swap_unreserve(1);
+				/* it may have the zero page mapped */
+				if (as != NULL) {
+					mmu_unmap(as,
+					     vmo->vmo_base+PAGE_SIZE*i);
+				}
+				if (!vmo->vmo_readonly &&
+				    vmo->vmo_vnpages == NULL) {
+					swap_unreserve(1);
+				}
 			}
 		}
 		result = lpage_array_setsize(vmo->vmo_lpages, npages);
@@ -175,6 +302,10 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 		int oldsize = lpage_array_num(vmo->vmo_lpages);
 		unsigned newpages = npages - oldsize;
 
+		/* Read-only and shared objects hold no reservation. */
+		KASSERT(!vmo->vmo_readonly);
+		KASSERT(vmo->vmo_vnpages == NULL);
+
 		result = swap_reserve(newpages);
 		if (result) {
 			return result;
@@ -205,7 +336,205 @@ vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 	result = vm_object_setsize(as, vmo, 0);
 	KASSERT(result==0);
 	
+	if (vmo->vmo_vnode != NULL) {
+		VOP_DECREF(vmo->vmo_vnode);
+	}
+	if (vmo->vmo_vnpages != NULL) {
+		vnpages_decref(vmo->vmo_vnpages);
+	}
+	spinlock_cleanup(&vmo->vmo_faultlock);
 	lpage_array_destroy(vmo->vmo_lpages);
 	kfree(vmo);
 }
 
+
+/*
+ * vm_object_fault_around: Called after a successful fault on page
+ * INDEX of VMO. Keeps track of whether the object is being faulted
+ * in page after page, and if so, prefetches the pages that follow
+ * from swap. The window starts small and grows with the length of
+ * the run, up to SWAP_MAXCLUSTER pages.
+ *
+ * Synchronization: the run is tracked under vmo_faultlock, so faults
+ * from several threads can't tear it; the prefetch itself locks each
+ * lpage as it goes.
+ */
+void
+vm_object_fault_around(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *lps[SWAP_MAXCLUSTER];
+	struct lpage *lp;
+	unsigned i, n, window, num, seqfaults;
+
+	spinlock_acquire(&vmo->vmo_faultlock);
+	if (index == vmo->vmo_nextfault) {
+		vmo->vmo_seqfaults++;
+	}
+	else {
+		vmo->vmo_seqfaults = 0;
+	}
+	vmo->vmo_nextfault = index + 1;
+	seqfaults = vmo->vmo_seqfaults;
+	spinlock_release(&vmo->vmo_faultlock);
+
+	if (seqfaults == 0) {
+		return;
+	}
+
+	window = 2 * seqfaults;
+	if (window > SWAP_MAXCLUSTER) {
+		window = SWAP_MAXCLUSTER;
+	}
+
+	num = lpage_array_num(vmo->vmo_lpages);
+	n = 0;
+	for (i = index + 1; i < num && n < window; i++) {
+		lp = lpage_array_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			/* zerofill; nothing on disk to read */
+			break;
+		}
+		lps[n++] = lp;
+	}
+
+	if (n > 0) {
+		lpage_prefetch(lps, n);
+	}
+}
+
+/*
+ * vm_object_hasfiledata: check whether any of the page of file-backed
+ * object VMO at VA comes from the file. If not, it's all zeros.
+ *
+ * Synchronization: none.
+ */
+bool
+vm_object_hasfiledata(struct vm_object *vmo, vaddr_t va)
+{
+	vaddr_t start, filestart, fileend;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+
+	start = va & PAGE_FRAME;
+	filestart = vmo->vmo_filevaddr;
+	fileend = filestart + vmo->vmo_filesize;
+
+	return start < fileend && start + PAGE_SIZE > filestart;
+}
+
+/*
+ * vm_object_readpage: fill physical page PA, which must be pinned,
+ * with the contents of the page of file-backed object VMO at VA.
+ * The parts of the page outside the file contents are zeroed.
+ *
+ * Synchronization: none; the page is pinned and not mapped, and the
+ * vnode does its own locking. May sleep.
+ */
+int
+vm_object_readpage(struct vm_object *vmo, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end, filestart, fileend;
+	char *kva;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(coremap_pageispinned(pa));
+
+	start = va & PAGE_FRAME;
+	end = start + PAGE_SIZE;
+	filestart = vmo->vmo_filevaddr;
+	fileend = filestart + vmo->vmo_filesize;
+
+	if (start < filestart || end > fileend) {
+		/* Not all of the page comes from the file. */
+		coremap_zero_page(pa);
+	}
+
+	if (start < filestart) {
+		start = filestart;
+	}
+	if (end > fileend) {
+		end = fileend;
+	}
+	if (start >= end) {
+		/* all bss */
+		return 0;
+	}
+
+	DEBUG(DB_VM, "vm: reading %lu bytes at 0x%x from file\n",
+	      (unsigned long)(end - start), start);
+
+	kva = (char *)coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, kva + (start & ~PAGE_FRAME), end - start,
+		  vmo->vmo_fileoffset + (start - filestart), UIO_READ);
+	result = VOP_READ(vmo->vmo_vnode, &ku);
+	coremap_unmap_swap_page(kva, pa);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("vm: short read on file page - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
+/*
+ * vm_object_writepage: write the part of physical page PA, which must
+ * be pinned, that holds file contents back to the file behind VMO.
+ * VA says which page of the object it is. The rest of the page is
+ * ignored, so the file never grows.
+ *
+ * Synchronization: as for vm_object_readpage.
+ */
+int
+vm_object_writepage(struct vm_object *vmo, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end, filestart, fileend;
+	char *kva;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(coremap_pageispinned(pa));
+
+	start = va & PAGE_FRAME;
+	end = start + PAGE_SIZE;
+	filestart = vmo->vmo_filevaddr;
+	fileend = filestart + vmo->vmo_filesize;
+
+	if (start < filestart) {
+		start = filestart;
+	}
+	if (end > fileend) {
+		end = fileend;
+	}
+	if (start >= end) {
+		/* all bss */
+		return 0;
+	}
+
+	DEBUG(DB_VM, "vm: writing %lu bytes at 0x%x to file\n",
+	      (unsigned long)(end - start), start);
+
+	kva = (char *)coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, kva + (start & ~PAGE_FRAME), end - start,
+		  vmo->vmo_fileoffset + (start - filestart), UIO_WRITE);
+	result = VOP_WRITE(vmo->vmo_vnode, &ku);
+	coremap_unmap_swap_page(kva, pa);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		return ENOSPC;
+	}
+
+	return 0;
+}
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <array.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <vmprivate.h>
+#include <machine/coremap.h>
+
+/*
+ * Shared pages of mapped files.
+ *
+ * MAP_SHARED mappings of the same file, in one process or many, all
+ * map the same physical pages: the ones in the file's vnpages table.
+ * A page is read from the file the first time any mapping touches
+ * it, and written back when the last mapping goes away. read() and
+ * write() on the file call vnpages_flush and vnpages_update so they
+ * see, and are seen by, stores through the mappings in between.
+ *
+ * The tables are kept on a list, which is short: files aren't often
+ * mapped shared, and the table goes when the last mapping does.
+ */
+
+static struct lock *vnpages_lock;	/* for the list and refcounts */
+static struct vnpages *vnpages_list;
+
+/*
+ * vnpages_bootstrap: set up the lock.
+ */
+void
+vnpages_bootstrap(void)
+{
+	vnpages_lock = lock_create("vnpages");
+	if (vnpages_lock == NULL) {
+		panic("vnpages_bootstrap: Out of memory\n");
+	}
+}
+
+/*
+ * vnpages_find: look up the table for V, if there is one.
+ *
+ * Synchronization: caller holds vnpages_lock.
+ */
+static
+struct vnpages *
+vnpages_find(struct vnode *v)
+{
+	struct vnpages *vnp;
+
+	KASSERT(lock_do_i_hold(vnpages_lock));
+
+	for (vnp = vnpages_list; vnp != NULL; vnp = vnp->vnp_next) {
+		if (vnp->vnp_vnode == v) {
+			return vnp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * vnpages_get: find the table for vnode V, creating it if need be,
+ * and add a reference to it. The table holds a reference to V.
+ * Returns NULL if out of memory.
+ */
+struct vnpages *
+vnpages_get(struct vnode *v)
+{
+	struct vnpages *vnp;
+
+	lock_acquire(vnpages_lock);
+	vnp = vnpages_find(v);
+	if (vnp != NULL) {
+		vnp->vnp_refcount++;
+		lock_release(vnpages_lock);
+		return vnp;
+	}
+
+	vnp = kmalloc(sizeof(struct vnpages));
+	if (vnp == NULL) {
+		lock_release(vnpages_lock);
+		return NULL;
+	}
+	vnp->vnp_lpages = lpage_array_create();
+	if (vnp->vnp_lpages == NULL) {
+		kfree(vnp);
+		lock_release(vnpages_lock);
+		return NULL;
+	}
+	vnp->vnp_lock = lock_create("vnpages table");
+	if (vnp->vnp_lock == NULL) {
+		lpage_array_destroy(vnp->vnp_lpages);
+		kfree(vnp);
+		lock_release(vnpages_lock);
+		return NULL;
+	}
+	VOP_INCREF(v);
+	vnp->vnp_vnode = v;
+	vnp->vnp_refcount = 1;
+	vnp->vnp_next = vnpages_list;
+	vnpages_list = vnp;
+	lock_release(vnpages_lock);
+
+	return vnp;
+}
+
+/*
+ * vnpages_incref: add a reference to a table someone already holds.
+ */
+void
+vnpages_incref(struct vnpages *vnp)
+{
+	lock_acquire(vnpages_lock);
+	KASSERT(vnp->vnp_refcount > 0);
+	vnp->vnp_refcount++;
+	lock_release(vnpages_lock);
+}
+
+/*
+ * vnpages_decref: drop a reference to a table. When the last one
+ * goes, write back the pages that were modified and free them all.
+ * There's no one to report a failure to by then, so just complain.
+ *
+ * Synchronization: the write-back is done holding vnpages_lock, so
+ * that a new mapping of the file can't read a page from it before
+ * the page has been written.
+ */
+void
+vnpages_decref(struct vnpages *vnp)
+{
+	struct vnpages **prev;
+	struct lpage *lp;
+	unsigned i, num;
+	int result;
+
+	lock_acquire(vnpages_lock);
+	KASSERT(vnp->vnp_refcount > 0);
+	if (--vnp->vnp_refcount > 0) {
+		lock_release(vnpages_lock);
+		return;
+	}
+
+	for (prev = &vnpages_list; *prev != vnp; prev = &(*prev)->vnp_next) {
+		KASSERT(*prev != NULL);
+	}
+	*prev = vnp->vnp_next;
+
+	num = lpage_array_num(vnp->vnp_lpages);
+	for (i = 0; i < num; i++) {
+		lp = lpage_array_get(vnp->vnp_lpages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		result = lpage_sharedsync(lp, vnp, i);
+		if (result) {
+			kprintf("vm: writing back mapped page: %s\n",
+				strerror(result));
+		}
+		lpage_destroy(lp);
+	}
+	lock_release(vnpages_lock);
+
+	lpage_array_setsize(vnp->vnp_lpages, 0);
+	lpage_array_destroy(vnp->vnp_lpages);
+	lock_destroy(vnp->vnp_lock);
+	VOP_DECREF(vnp->vnp_vnode);
+	kfree(vnp);
+}
+
+/*
+ * vnpages_getpage: hand back page INDEX of the file, reading it in if
+ * no mapping has touched it yet. The table keeps the page; the caller
+ * gets no reference of its own, and must hold a reference to the
+ * table for as long as it uses the page.
+ *
+ * Each page holds one swap reservation, which it gives back when it
+ * is destroyed.
+ *
+ * Synchronization: vnp_lock is not held while reading. We can get
+ * here from a fault in the middle of a VOP_READ or VOP_WRITE, with
+ * the vnode locked; if we could then wait for vnp_lock, a thread
+ * holding it could be waiting for the vnode. So read the page first,
+ * and if someone else installed it meanwhile, throw ours away.
+ */
+int
+vnpages_getpage(struct vnpages *vnp, unsigned index, struct lpage **lpret)
+{
+	struct lpage *lp, *newlp;
+	unsigned i, num;
+	int result;
+
+	lock_acquire(vnp->vnp_lock);
+	lp = NULL;
+	if (index < lpage_array_num(vnp->vnp_lpages)) {
+		lp = lpage_array_get(vnp->vnp_lpages, index);
+	}
+	lock_release(vnp->vnp_lock);
+
+	if (lp != NULL) {
+		*lpret = lp;
+		return 0;
+	}
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+	result = lpage_sharedload(vnp, index, &newlp);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	lock_acquire(vnp->vnp_lock);
+	num = lpage_array_num(vnp->vnp_lpages);
+	if (index >= num) {
+		result = lpage_array_setsize(vnp->vnp_lpages, index + 1);
+		if (result) {
+			lock_release(vnp->vnp_lock);
+			lpage_destroy(newlp);
+			return result;
+		}
+		for (i = num; i <= index; i++) {
+			lpage_array_set(vnp->vnp_lpages, i, NULL);
+		}
+	}
+	lp = lpage_array_get(vnp->vnp_lpages, index);
+	if (lp == NULL) {
+		lp = newlp;
+		newlp = NULL;
+		lpage_array_set(vnp->vnp_lpages, index, lp);
+	}
+	lock_release(vnp->vnp_lock);
+
+	if (newlp != NULL) {
+		/* Someone else loaded it first. */
+		lpage_destroy(newlp);
+	}
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * vnpages_lookup: get page INDEX of the table, or NULL if it hasn't
+ * been loaded (or is past the end). The page can't go away while the
+ * caller holds a reference to the table.
+ */
+static
+struct lpage *
+vnpages_lookup(struct vnpages *vnp, unsigned index)
+{
+	struct lpage *lp;
+
+	lock_acquire(vnp->vnp_lock);
+	lp = NULL;
+	if (index < lpage_array_num(vnp->vnp_lpages)) {
+		lp = lpage_array_get(vnp->vnp_lpages, index);
+	}
+	lock_release(vnp->vnp_lock);
+	return lp;
+}
+
+/*
+ * vnpages_readpage: fill physical page PA, which must be pinned, with
+ * page INDEX of the file. The part past the end of the file is zeroed.
+ *
+ * Synchronization: none; the vnode does its own locking. May sleep.
+ */
+int
+vnpages_readpage(struct vnpages *vnp, unsigned index, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva;
+	int result;
+
+	KASSERT(coremap_pageispinned(pa));
+
+	kva = (char *)coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, kva, PAGE_SIZE, (off_t)index * PAGE_SIZE,
+		  UIO_READ);
+	result = VOP_READ(vnp->vnp_vnode, &ku);
+	if (result == 0 && ku.uio_resid > 0) {
+		bzero(kva + PAGE_SIZE - ku.uio_resid, ku.uio_resid);
+	}
+	coremap_unmap_swap_page(kva, pa);
+
+	return result;
+}
+
+/*
+ * vnpages_writepage: write physical page PA, which must be pinned,
+ * back to page INDEX of the file. Only the part inside the file is
+ * written, so the file never grows.
+ *
+ * Synchronization: as for vnpages_readpage.
+ */
+int
+vnpages_writepage(struct vnpages *vnp, unsigned index, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t pos;
+	size_t len;
+	char *kva;
+	int result;
+
+	KASSERT(coremap_pageispinned(pa));
+
+	result = VOP_STAT(vnp->vnp_vnode, &st);
+	if (result) {
+		return result;
+	}
+	pos = (off_t)index * PAGE_SIZE;
+	if (st.st_size <= pos) {
+		return 0;
+	}
+	len = PAGE_SIZE;
+	if (st.st_size - pos < (off_t)len) {
+		len = st.st_size - pos;
+	}
+
+	kva = (char *)coremap_map_swap_page(pa);
+	uio_kinit(&iov, &ku, kva, len, pos, UIO_WRITE);
+	result = VOP_WRITE(vnp->vnp_vnode, &ku);
+	coremap_unmap_swap_page(kva, pa);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		return ENOSPC;
+	}
+	return 0;
+}
+
+/*
+ * vnpages_hold: find the table for V and add a reference to it, for
+ * read() and write(). Returns NULL if the file has no shared mappings.
+ *
+ * The list is looked at first without the lock; if it's empty, nothing
+ * is mapped shared anywhere and the common case is done. A mapping
+ * made concurrently with the read or write may or may not be seen,
+ * but then it may as well have been made just after.
+ */
+static
+struct vnpages *
+vnpages_hold(struct vnode *v)
+{
+	struct vnpages *vnp;
+
+	if (vnpages_list == NULL) {
+		return NULL;
+	}
+
+	lock_acquire(vnpages_lock);
+	vnp = vnpages_find(v);
+	if (vnp != NULL) {
+		vnp->vnp_refcount++;
+	}
+	lock_release(vnpages_lock);
+	return vnp;
+}
+
+/*
+ * vnpages_flush: write back every page of V changed through a shared
+ * mapping, so that read() sees it and write() doesn't get overwritten
+ * by it later. Failures are reported to the console; the page stays
+ * modified and will be written again next time.
+ */
+void
+vnpages_flush(struct vnode *v)
+{
+	struct vnpages *vnp;
+	struct lpage *lp;
+	unsigned i, num;
+	int result;
+
+	vnp = vnpages_hold(v);
+	if (vnp == NULL) {
+		return;
+	}
+
+	lock_acquire(vnp->vnp_lock);
+	num = lpage_array_num(vnp->vnp_lpages);
+	lock_release(vnp->vnp_lock);
+
+	for (i = 0; i < num; i++) {
+		lp = vnpages_lookup(vnp, i);
+		if (lp == NULL) {
+			continue;
+		}
+		result = lpage_sharedsync(lp, vnp, i);
+		if (result) {
+			kprintf("vm: writing back mapped page: %s\n",
+				strerror(result));
+		}
+	}
+
+	vnpages_decref(vnp);
+}
+
+/*
+ * vnpages_update: after write() has put LEN bytes at POS in V, read
+ * the pages that covers from the file again, so the shared mappings
+ * see it.
+ */
+void
+vnpages_update(struct vnode *v, off_t pos, size_t len)
+{
+	struct vnpages *vnp;
+	struct lpage *lp;
+	unsigned i, first, last;
+	int result;
+
+	if (len == 0) {
+		return;
+	}
+
+	vnp = vnpages_hold(v);
+	if (vnp == NULL) {
+		return;
+	}
+
+	first = pos / PAGE_SIZE;
+	last = (pos + len - 1) / PAGE_SIZE;
+
+	for (i = first; i <= last; i++) {
+		lp = vnpages_lookup(vnp, i);
+		if (lp == NULL) {
+			continue;
+		}
+		result = lpage_sharedreload(lp, vnp, i);
+		if (result) {
+			kprintf("vm: reloading mapped page: %s\n",
+				strerror(result));
+		}
+	}
+
+	vnpages_decref(vnp);
+}
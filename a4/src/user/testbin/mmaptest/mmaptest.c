@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * mmaptest.c
+ *
+ *	Tests file and anonymous mappings:
+ *	  - writes to a MAP_PRIVATE file mapping stay private: another
+ *	    mapping of the file and the file itself don't see them;
+ *	  - writes to a MAP_SHARED file mapping reach the file, and are
+ *	    seen through read() once the mapping is removed;
+ *	  - MAP_SHARED mappings of a file all see the same pages, as do
+ *	    read() and write() on the file while it's mapped, and a
+ *	    forked child's copy of the mapping;
+ *	  - munmap removes mappings whole: unmapping part of one fails
+ *	    and leaves it alone, and unmapping all of it frees the range.
+ *
+ * Usage: mmaptest [scratchfile]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		4
+
+static char buf[PAGE_SIZE];
+
+/*
+ * Create FILE holding NPAGES pages; page I is filled with 'a'+I.
+ */
+static
+void
+makefile(const char *file)
+{
+	unsigned i;
+	int fd, r;
+
+	fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", file);
+	}
+	for (i=0; i<NPAGES; i++) {
+		memset(buf, 'a' + i, PAGE_SIZE);
+		r = write(fd, buf, PAGE_SIZE);
+		if (r < 0) {
+			err(1, "%s: write", file);
+		}
+		if (r != PAGE_SIZE) {
+			errx(1, "%s: short write", file);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Check that page PAGE of the memory at P is all C.
+ */
+static
+void
+checkmem(const char *what, const char *p, unsigned page, char c)
+{
+	unsigned j;
+
+	for (j=0; j<PAGE_SIZE; j++) {
+		if (p[page*PAGE_SIZE + j] != c) {
+			errx(1, "%s: page %u byte %u: expected %c, got %d",
+			     what, page, j, c, p[page*PAGE_SIZE + j]);
+		}
+	}
+}
+
+/*
+ * Check that page PAGE of FILE, read with read(), is all C.
+ */
+static
+void
+checkfile(const char *file, unsigned page, char c)
+{
+	unsigned j;
+	int fd, r;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	if (lseek(fd, page*PAGE_SIZE, SEEK_SET) < 0) {
+		err(1, "%s: lseek", file);
+	}
+	r = read(fd, buf, PAGE_SIZE);
+	if (r < 0) {
+		err(1, "%s: read", file);
+	}
+	if (r != PAGE_SIZE) {
+		errx(1, "%s: short read", file);
+	}
+	close(fd);
+
+	for (j=0; j<PAGE_SIZE; j++) {
+		if (buf[j] != c) {
+			errx(1, "%s: page %u byte %u: expected %c, got %d",
+			     file, page, j, c, buf[j]);
+		}
+	}
+}
+
+static
+char *
+mapfile(int fd, int flags)
+{
+	void *p;
+
+	p = mmap(NULL, NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+privatetest(const char *file)
+{
+	char *p, *q;
+	unsigned i;
+	int fd;
+
+	printf("MAP_PRIVATE: copy on write...\n");
+	makefile(file);
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mapfile(fd, MAP_PRIVATE);
+	q = mapfile(fd, MAP_PRIVATE);
+	close(fd);
+
+	for (i=0; i<NPAGES; i++) {
+		checkmem("first mapping", p, i, 'a' + i);
+	}
+
+	/* Write to page 1 of one mapping only */
+	memset(p + PAGE_SIZE, 'X', PAGE_SIZE);
+	checkmem("first mapping", p, 1, 'X');
+	for (i=0; i<NPAGES; i++) {
+		checkmem("second mapping", q, i, 'a' + i);
+	}
+
+	if (munmap(p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	if (munmap(q, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	for (i=0; i<NPAGES; i++) {
+		checkfile(file, i, 'a' + i);
+	}
+}
+
+static
+void
+sharedtest(const char *file)
+{
+	char *p;
+	int fd;
+
+	printf("MAP_SHARED: writes reach the file...\n");
+	makefile(file);
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mapfile(fd, MAP_SHARED);
+	close(fd);
+
+	/* Read page 0, write page 2, leave the rest untouched */
+	checkmem("shared mapping", p, 0, 'a');
+	memset(p + 2*PAGE_SIZE, 'Y', PAGE_SIZE);
+
+	if (munmap(p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	checkfile(file, 0, 'a');
+	checkfile(file, 1, 'b');
+	checkfile(file, 2, 'Y');
+	checkfile(file, 3, 'd');
+}
+
+static
+void
+coherencetest(const char *file)
+{
+	char *p, *q;
+	int fd, r;
+
+	printf("MAP_SHARED: mappings, read, and write agree...\n");
+	makefile(file);
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mapfile(fd, MAP_SHARED);
+	q = mapfile(fd, MAP_SHARED);
+
+	/* A store through one mapping shows in the other and in read() */
+	memset(p + PAGE_SIZE, 'S', PAGE_SIZE);
+	checkmem("other shared mapping", q, 1, 'S');
+	checkfile(file, 1, 'S');
+
+	/* and write() shows in both mappings */
+	memset(buf, 'W', PAGE_SIZE);
+	if (lseek(fd, 3*PAGE_SIZE, SEEK_SET) < 0) {
+		err(1, "%s: lseek", file);
+	}
+	r = write(fd, buf, PAGE_SIZE);
+	if (r < 0) {
+		err(1, "%s: write", file);
+	}
+	if (r != PAGE_SIZE) {
+		errx(1, "%s: short write", file);
+	}
+	close(fd);
+	checkmem("shared mapping after write", p, 3, 'W');
+	checkmem("other shared mapping after write", q, 3, 'W');
+
+	if (munmap(p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	if (munmap(q, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	checkfile(file, 0, 'a');
+	checkfile(file, 1, 'S');
+	checkfile(file, 2, 'c');
+	checkfile(file, 3, 'W');
+}
+
+static
+void
+forktest(const char *file)
+{
+	char *p;
+	pid_t pid;
+	int fd, status;
+
+	printf("MAP_SHARED: shared with a forked child...\n");
+	makefile(file);
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mapfile(fd, MAP_SHARED);
+	close(fd);
+
+	/* Touch a page first, so the child gets it already mapped */
+	memset(p, 'P', PAGE_SIZE);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		checkmem("child's shared mapping", p, 0, 'P');
+		memset(p, 'C', PAGE_SIZE);
+		memset(p + 2*PAGE_SIZE, 'C', PAGE_SIZE);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+
+	checkmem("parent's shared mapping", p, 0, 'C');
+	checkmem("parent's shared mapping", p, 2, 'C');
+	if (munmap(p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	checkfile(file, 0, 'C');
+	checkfile(file, 1, 'b');
+	checkfile(file, 2, 'C');
+}
+
+static
+void
+unmaptest(void)
+{
+	char *p, *q;
+
+	printf("munmap: partial and whole...\n");
+	p = mmap(NULL, NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	memset(p, 'Z', NPAGES*PAGE_SIZE);
+
+	if (munmap(p + PAGE_SIZE, PAGE_SIZE) == 0) {
+		errx(1, "munmap of part of a mapping succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "munmap of part of a mapping: expected EINVAL, got");
+	}
+	checkmem("anon mapping", p, 1, 'Z');
+	checkmem("anon mapping", p, NPAGES-1, 'Z');
+
+	q = mmap(p, PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE|MAP_FIXED, -1, 0);
+	if (q != MAP_FAILED) {
+		errx(1, "MAP_FIXED over a live mapping succeeded");
+	}
+
+	if (munmap(p, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+
+	/*
+	 * The pages are gone now. MAP_FIXED won't map over anything, so
+	 * mapping the same range again shows it's free, and it must come
+	 * back zero-filled rather than with the old contents.
+	 */
+	q = mmap(p, NPAGES*PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE|MAP_FIXED, -1, 0);
+	if (q == MAP_FAILED) {
+		err(1, "mmap over an unmapped range");
+	}
+	if (q != p) {
+		errx(1, "MAP_FIXED mapping went to %p, not %p", q, p);
+	}
+	checkmem("remapped range", q, 1, 0);
+	if (munmap(q, NPAGES*PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file;
+
+	file = argc > 1 ? argv[1] : "mmaptest.tmp";
+
+	privatetest(file);
+	sharedtest(file);
+	coherencetest(file);
+	forktest(file);
+	unmaptest();
+	remove(file);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * sbrktest.c
+ *
+ *	Tests moving the break: growing the heap, shrinking it again,
+ *	and being refused when the heap would run into a mapping above
+ *	it.
+ *
+ * This needs sbrk, and for the last part mmap with MAP_FIXED.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		16
+
+static
+char *
+getbreak(void)
+{
+	void *p;
+
+	p = sbrk(0);
+	if (p == (void *)-1) {
+		err(1, "sbrk(0)");
+	}
+	return p;
+}
+
+/*
+ * Fill the pages at P with a pattern derived from their page number,
+ * or check that they still hold it.
+ */
+static
+void
+fillpages(char *p, unsigned first, unsigned num)
+{
+	unsigned i;
+
+	for (i=first; i<first+num; i++) {
+		memset(p + i*PAGE_SIZE, 'a' + i % 26, PAGE_SIZE);
+	}
+}
+
+static
+void
+checkpages(char *p, unsigned first, unsigned num)
+{
+	unsigned i, j;
+	char c;
+
+	for (i=first; i<first+num; i++) {
+		c = 'a' + i % 26;
+		for (j=0; j<PAGE_SIZE; j++) {
+			if (p[i*PAGE_SIZE + j] != c) {
+				errx(1, "page %u byte %u: expected %c, got %d",
+				     i, j, c, p[i*PAGE_SIZE + j]);
+			}
+		}
+	}
+}
+
+static
+void
+checkzero(char *p, unsigned first, unsigned num)
+{
+	unsigned i, j;
+
+	for (i=first; i<first+num; i++) {
+		for (j=0; j<PAGE_SIZE; j++) {
+			if (p[i*PAGE_SIZE + j] != 0) {
+				errx(1, "page %u byte %u: not zero-filled",
+				     i, j);
+			}
+		}
+	}
+}
+
+/*
+ * Grow the heap by NPAGES pages and use all of it.
+ */
+static
+char *
+growtest(void)
+{
+	char *old, *p;
+
+	printf("Growing the heap by %d pages...\n", NPAGES);
+	old = getbreak();
+	p = sbrk(NPAGES*PAGE_SIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk(%d)", NPAGES*PAGE_SIZE);
+	}
+	if (p != old) {
+		errx(1, "sbrk returned %p, but the break was %p", p, old);
+	}
+	if (getbreak() != old + NPAGES*PAGE_SIZE) {
+		errx(1, "break is %p after growing, expected %p",
+		     getbreak(), old + NPAGES*PAGE_SIZE);
+	}
+
+	fillpages(p, 0, NPAGES);
+	checkpages(p, 0, NPAGES);
+	return p;
+}
+
+/*
+ * Give back the top half of the heap grown above, check the bottom
+ * half is untouched, and grow again: the returned pages must come
+ * back zero-filled, not with their old contents.
+ */
+static
+void
+shrinktest(char *p)
+{
+	char *q;
+
+	printf("Shrinking the heap by %d pages...\n", NPAGES/2);
+	q = sbrk(-(NPAGES/2)*PAGE_SIZE);
+	if (q == (void *)-1) {
+		err(1, "sbrk(%d)", -(NPAGES/2)*PAGE_SIZE);
+	}
+	if (q != p + NPAGES*PAGE_SIZE) {
+		errx(1, "sbrk returned %p, but the break was %p",
+		     q, p + NPAGES*PAGE_SIZE);
+	}
+	if (getbreak() != p + (NPAGES/2)*PAGE_SIZE) {
+		errx(1, "break is %p after shrinking, expected %p",
+		     getbreak(), p + (NPAGES/2)*PAGE_SIZE);
+	}
+	checkpages(p, 0, NPAGES/2);
+
+	printf("Growing it back...\n");
+	q = sbrk((NPAGES/2)*PAGE_SIZE);
+	if (q == (void *)-1) {
+		err(1, "sbrk(%d)", (NPAGES/2)*PAGE_SIZE);
+	}
+	checkpages(p, 0, NPAGES/2);
+	checkzero(p, NPAGES/2, NPAGES/2);
+}
+
+/*
+ * Put a mapping a few pages above the break and check that the heap
+ * may grow up to it but not into it.
+ */
+static
+void
+collidetest(void)
+{
+	char *brk, *top, *m, *q;
+
+	brk = getbreak();
+	top = (char *)(((uintptr_t)brk + PAGE_SIZE - 1) &
+		       ~(uintptr_t)(PAGE_SIZE - 1));
+
+	printf("Mapping a page at %p, above the break at %p...\n",
+	       top + 4*PAGE_SIZE, brk);
+	m = mmap(top + 4*PAGE_SIZE, PAGE_SIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE|MAP_FIXED, -1, 0);
+	if (m == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	if (m != top + 4*PAGE_SIZE) {
+		errx(1, "MAP_FIXED mapping went to %p", m);
+	}
+
+	printf("Growing the heap into it...\n");
+	q = sbrk(8*PAGE_SIZE);
+	if (q != (void *)-1) {
+		errx(1, "sbrk into a mapping succeeded");
+	}
+	if (errno != ENOMEM) {
+		err(1, "sbrk into a mapping: expected ENOMEM, got");
+	}
+	if (getbreak() != brk) {
+		errx(1, "break moved from %p to %p on a failed sbrk",
+		     brk, getbreak());
+	}
+
+	printf("Growing the heap up to it...\n");
+	q = sbrk(top + 4*PAGE_SIZE - brk);
+	if (q == (void *)-1) {
+		err(1, "sbrk up to a mapping");
+	}
+	memset(brk, 'x', top + 4*PAGE_SIZE - brk);
+
+	printf("Removing the mapping and growing past it...\n");
+	if (munmap(m, PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	q = sbrk(8*PAGE_SIZE);
+	if (q == (void *)-1) {
+		err(1, "sbrk after munmap");
+	}
+	memset(q, 'y', 8*PAGE_SIZE);
+}
+
+int
+main(void)
+{
+	char *p;
+
+	p = growtest();
+	shrinktest(p);
+	collidetest();
+	printf("Passed sbrktest.\n");
+	return 0;
+}